@@ -0,0 +1,481 @@
+#include "globals.h"
+#include "hal.h"
+#include "os.h"
+#include "ring.h"
+#include "serial.h"
+#include "synchro.h"
+#include <stdbool.h>
+
+/*
+ * Kernel micro-benchmarks. Two worker threads of equal priority run each
+ * benchmark in turn under a controller thread, timing every iteration with
+ * cycle_count(), and the controller prints one CSV line per benchmark:
+ *
+ *   name,iterations,min,avg,max
+ *
+ * Times are CPU cycles on the AVR (use `make bench` to run under simavr) and
+ * nanoseconds on the host (`make bench-host`). Must be built with
+ * -DOS_INSTRUMENT.
+ *
+ * idle_ticks and idle_interrupts are counts rather than times: the ticks
+ * that pass while a thread sleeps with nothing else to run, and the tick
+ * interrupts taken meanwhile. With tickless idle on the AVR there are far
+ * fewer interrupts than ticks; the host always takes every tick.
+ */
+
+#ifndef OS_INSTRUMENT
+#error "bench.c needs cycle_count(), build it with -DOS_INSTRUMENT"
+#endif
+
+#define ITERATIONS 200
+// bytes moved through the ring by each ring benchmark iteration
+#define RING_BLOCK 32
+// iterations of the low priority thread's critical section in the priority
+// inversion benchmark, long enough to stand out from a context switch
+#define CRITICAL_LOOPS 200
+// sleeps timed by the idle benchmark, and the ticks each one lasts
+#define IDLE_ITERATIONS 20
+#define IDLE_TICKS 10
+#define WORKER_PRIORITY PRIORITY_DEFAULT
+
+struct bench_result {
+  char* name;
+  uint16_t iterations;
+  hal_cycles_t min;
+  hal_cycles_t max;
+  uint32_t total;
+};
+
+enum bench_id {
+  BENCH_YIELD = 0,
+  BENCH_SEM_PING_PONG,
+  BENCH_MUTEX_PING_PONG,
+  BENCH_SLEEP_WAKEUP,
+  BENCH_SERIAL_WRITE,
+  BENCH_FORMAT_INT,
+  BENCH_FORMAT_INT32,
+  BENCH_FORMAT_HEX,
+  BENCH_FORMAT_HEX32,
+  BENCH_FORMAT_COLOR,
+  BENCH_FORMAT_CURSOR,
+  BENCH_RING_BYTE,
+  BENCH_RING_BULK,
+  BENCH_RING_PEEK,
+  BENCH_SPAWN_JOIN,
+  BENCH_INVERSION_BLOCKED,
+  BENCH_INVERSION_SECTION,
+  BENCH_IDLE_TICKS,
+  BENCH_IDLE_INTERRUPTS,
+  BENCH_TICK_ISR,
+  NUM_BENCHES
+};
+
+static struct bench_result results[NUM_BENCHES] = {
+    {"yield"}, {"sem_ping_pong"}, {"mutex_ping_pong"},
+    {"sleep_wakeup"}, {"serial_write"}, {"format_int"}, {"format_int32"},
+    {"format_hex"}, {"format_hex32"}, {"format_color"}, {"format_cursor"},
+    {"ring_byte"}, {"ring_bulk"}, {"ring_peek"}, {"spawn_join"},
+    {"inversion_blocked"}, {"inversion_section"}, {"idle_ticks"},
+    {"idle_interrupts"}, {"tick_isr"}};
+
+static volatile uint8_t phase;
+static struct semaphore_t go[2];
+static struct semaphore_t done;
+static struct semaphore_t ping;
+static struct semaphore_t pong;
+static struct mutex_t m;
+
+// when the other worker started the operation being timed
+static volatile hal_cycles_t stamp;
+static volatile uint8_t stampedBy;
+static volatile bool sleeping;
+static volatile bool spinning;
+
+static void record(struct bench_result* r, hal_cycles_t cycles) {
+  if (r->iterations == 0 || cycles < r->min) {
+    r->min = cycles;
+  }
+  if (cycles > r->max) {
+    r->max = cycles;
+  }
+  r->total += cycles;
+  r->iterations++;
+}
+
+// each worker yields to the other, timing from one yield to the other
+// worker resuming; the first to run has nothing to time
+static void bench_yield(uint8_t role) {
+  for (uint16_t i = 0; i < ITERATIONS; i++) {
+    if (stampedBy != role && stampedBy != UINT8_MAX) {
+      record(&results[BENCH_YIELD], cycle_count() - stamp);
+    }
+    stampedBy = role;
+    stamp = cycle_count();
+    yield();
+  }
+}
+
+// a signal followed by a blocking wait, timed until the other worker
+// returns from its wait
+static void bench_sem(uint8_t role) {
+  struct bench_result* r = &results[BENCH_SEM_PING_PONG];
+  for (uint16_t i = 0; i < ITERATIONS; i++) {
+    if (role == 0) {
+      stamp = cycle_count();
+      sem_signal(&ping);
+      sem_wait(&pong);
+      record(r, cycle_count() - stamp);
+    } else {
+      sem_wait(&ping);
+      record(r, cycle_count() - stamp);
+      stamp = cycle_count();
+      sem_signal(&pong);
+    }
+  }
+}
+
+// an unlock that hands the mutex to the other worker, followed by a lock
+// that blocks, timed until the other worker returns from its lock
+static void bench_mutex(uint8_t role) {
+  struct bench_result* r = &results[BENCH_MUTEX_PING_PONG];
+  if (role == 0) {
+    mutex_lock(&m);
+    // let the other worker block on the mutex
+    yield();
+    for (uint16_t i = 0; i < ITERATIONS; i++) {
+      stamp = cycle_count();
+      mutex_unlock(&m);
+      mutex_lock(&m);
+      record(r, cycle_count() - stamp);
+    }
+    mutex_unlock(&m);
+  } else {
+    for (uint16_t i = 0; i < ITERATIONS; i++) {
+      mutex_lock(&m);
+      record(r, cycle_count() - stamp);
+      stamp = cycle_count();
+      mutex_unlock(&m);
+    }
+  }
+}
+
+// one worker sleeps for a tick while the other spins, timing from the start
+// of the tick ISR to the sleeper resuming
+static void bench_sleep(uint8_t role) {
+  if (role == 0) {
+    for (uint16_t i = 0; i < ITERATIONS; i++) {
+      thread_sleep(1);
+      record(&results[BENCH_SLEEP_WAKEUP], cycle_count() - tickStart);
+      record(&results[BENCH_TICK_ISR], tickCycles);
+    }
+    sleeping = false;
+  } else {
+    // keep the CPU busy so the tick is not skipped by tickless idle
+    while (sleeping) {
+    }
+  }
+}
+
+// the time a thread spends writing a short line, which goes into the
+// transmit buffer rather than waiting for the port; carriage returns keep
+// the CSV output clean
+static void bench_serial(uint8_t role) {
+  if (role != 0) {
+    return;
+  }
+  for (uint16_t i = 0; i < ITERATIONS; i++) {
+    stamp = cycle_count();
+    print_string("\r\r\r\r\r\r\r\r\r\r\r\r\r\r\r\r");
+    record(&results[BENCH_SERIAL_WRITE], cycle_count() - stamp);
+    serial_flush();
+  }
+}
+
+// the conversion behind each print_* function, without the output; the
+// values cover the widest numbers and escape sequences
+static void bench_format(uint8_t role) {
+  if (role != 0) {
+    return;
+  }
+  struct bench_result* r = &results[phase];
+  char s[FORMAT_INT32_SIZE];
+  for (uint16_t i = 0; i < ITERATIONS; i++) {
+    hal_cycles_t start = cycle_count();
+    switch (phase) {
+    case BENCH_FORMAT_INT:
+      format_int(s, UINT16_MAX - i);
+      break;
+    case BENCH_FORMAT_INT32:
+      format_int32(s, UINT32_MAX - i);
+      break;
+    case BENCH_FORMAT_HEX:
+      format_hex(s, UINT16_MAX - i);
+      break;
+    case BENCH_FORMAT_HEX32:
+      format_hex32(s, UINT32_MAX - i);
+      break;
+    case BENCH_FORMAT_COLOR:
+      format_color(s, WHITE);
+      break;
+    case BENCH_FORMAT_CURSOR:
+      format_cursor(s, MAX_ROW, MAX_COL + 91);
+      break;
+    default:
+      break;
+    }
+    record(r, cycle_count() - start);
+  }
+}
+
+RING_DEFINE(bench_ring, uint8_t, 64)
+
+static struct bench_ring ring;
+
+// a block in and out of a ring, one byte per call, with put_n and get_n, or
+// filled and drained in place; the ring's indexes advance by less than its
+// size each time so that the blocks wrap around its end
+static void bench_ring(uint8_t role) {
+  if (role != 0) {
+    return;
+  }
+  struct bench_result* r = &results[phase];
+  uint8_t in[RING_BLOCK];
+  uint8_t out[RING_BLOCK];
+  for (uint8_t i = 0; i < RING_BLOCK; i++) {
+    in[i] = i;
+  }
+  bench_ring_init(&ring);
+  for (uint16_t i = 0; i < ITERATIONS; i++) {
+    hal_cycles_t start = cycle_count();
+    switch (phase) {
+    case BENCH_RING_BYTE:
+      for (uint8_t j = 0; j < RING_BLOCK; j++) {
+        bench_ring_put(&ring, in[j]);
+      }
+      for (uint8_t j = 0; j < RING_BLOCK; j++) {
+        bench_ring_get(&ring, &out[j]);
+      }
+      break;
+    case BENCH_RING_BULK:
+      bench_ring_put_n(&ring, in, RING_BLOCK);
+      bench_ring_get_n(&ring, out, RING_BLOCK);
+      break;
+    case BENCH_RING_PEEK:
+      for (uint8_t done = 0, n; done < RING_BLOCK; done += n) {
+        uint8_t* p = bench_ring_put_peek(&ring, &n);
+        n = n < RING_BLOCK - done ? n : RING_BLOCK - done;
+        for (uint8_t j = 0; j < n; j++) {
+          p[j] = done + j;
+        }
+        bench_ring_put_commit(&ring, n);
+      }
+      for (uint8_t n; (n = bench_ring_count(&ring)) > 0;) {
+        uint8_t* p = bench_ring_get_peek(&ring, &n);
+        uint8_t sum = 0;
+        for (uint8_t j = 0; j < n; j++) {
+          sum += p[j];
+        }
+        out[0] = sum;
+        bench_ring_get_commit(&ring, n);
+      }
+      break;
+    default:
+      break;
+    }
+    record(r, cycle_count() - start);
+  }
+}
+
+static void job(void* args) { *(uint16_t*)args += 1; }
+
+// a short-lived thread created, run to the end of its function and joined,
+// each in a slot and on a stack left by the one before
+static void bench_spawn(uint8_t role) {
+  if (role != 0) {
+    return;
+  }
+  uint16_t jobsRun = 0;
+  for (uint16_t i = 0; i < ITERATIONS; i++) {
+    hal_cycles_t start = cycle_count();
+    uint8_t id = create_thread("job", job, &jobsRun, 64, WORKER_PRIORITY);
+    thread_join(id, WAIT_FOREVER);
+    record(&results[BENCH_SPAWN_JOIN], cycle_count() - start);
+  }
+  if (jobsRun != ITERATIONS) {
+    print_string("spawn_join: jobs lost\r\n");
+  }
+}
+
+// one worker sleeps while the other is blocked, counting the ticks that
+// pass and the tick interrupts taken, both read with interrupts disabled as
+// the tick updates them
+static void bench_idle(uint8_t role) {
+  if (role != 0) {
+    return;
+  }
+  for (uint16_t i = 0; i < IDLE_ITERATIONS; i++) {
+    cli();
+    uint32_t ticks = isrCounterMilli;
+    uint32_t interrupts = tickInterrupts;
+    sei();
+    thread_sleep(IDLE_TICKS);
+    cli();
+    ticks = isrCounterMilli - ticks;
+    interrupts = tickInterrupts - interrupts;
+    sei();
+    record(&results[BENCH_IDLE_TICKS], ticks);
+    record(&results[BENCH_IDLE_INTERRUPTS], interrupts);
+  }
+}
+
+// Priority inversion: a low priority thread holds the mutex that a high
+// priority thread blocks on, while a medium priority thread spins. The high
+// thread's wait is timed, as is the low thread's whole critical section.
+// Priority inheritance lets the low thread finish ahead of the spinning one,
+// so the wait stays within the critical section; without it, the medium
+// thread would spin forever and the benchmark would never finish.
+static void inversion_high(void* args) {
+  stamp = cycle_count();
+  mutex_lock(&m);
+  record(&results[BENCH_INVERSION_BLOCKED], cycle_count() - stamp);
+  mutex_unlock(&m);
+  spinning = false;
+}
+
+// starts the high thread, which blocks at once, then spins until it has
+// had the mutex
+static void inversion_medium(void* args) {
+  create_thread("high", inversion_high, NULL, 64, WORKER_PRIORITY + 3);
+  while (spinning) {
+  }
+}
+
+// the medium and high threads preempt it as soon as they are created, and
+// it runs last, after both have ended
+static void inversion_low(void* args) {
+  mutex_lock(&m);
+  hal_cycles_t start = cycle_count();
+  create_thread("medium", inversion_medium, NULL, 64, WORKER_PRIORITY + 2);
+  for (volatile uint16_t i = 0; i < CRITICAL_LOOPS; i++) {
+  }
+  record(&results[BENCH_INVERSION_SECTION], cycle_count() - start);
+  mutex_unlock(&m);
+}
+
+static void bench_inversion(uint8_t role) {
+  if (role != 0) {
+    return;
+  }
+  for (uint16_t i = 0; i < ITERATIONS; i++) {
+    spinning = true;
+    uint8_t id =
+        create_thread("low", inversion_low, NULL, 64, WORKER_PRIORITY + 1);
+    thread_join(id, WAIT_FOREVER);
+  }
+}
+
+static void worker(void* args) {
+  uint8_t role = (uintptr_t)args;
+  while (true) {
+    sem_wait(&go[role]);
+    switch (phase) {
+    case BENCH_YIELD:
+      bench_yield(role);
+      break;
+    case BENCH_SEM_PING_PONG:
+      bench_sem(role);
+      break;
+    case BENCH_MUTEX_PING_PONG:
+      bench_mutex(role);
+      break;
+    case BENCH_SLEEP_WAKEUP:
+      bench_sleep(role);
+      break;
+    case BENCH_SERIAL_WRITE:
+      bench_serial(role);
+      break;
+    case BENCH_FORMAT_INT:
+    case BENCH_FORMAT_INT32:
+    case BENCH_FORMAT_HEX:
+    case BENCH_FORMAT_HEX32:
+    case BENCH_FORMAT_COLOR:
+    case BENCH_FORMAT_CURSOR:
+      bench_format(role);
+      break;
+    case BENCH_RING_BYTE:
+    case BENCH_RING_BULK:
+    case BENCH_RING_PEEK:
+      bench_ring(role);
+      break;
+    case BENCH_SPAWN_JOIN:
+      bench_spawn(role);
+      break;
+    case BENCH_INVERSION_BLOCKED:
+      bench_inversion(role);
+      break;
+    case BENCH_IDLE_TICKS:
+      bench_idle(role);
+      break;
+    default:
+      break;
+    }
+    sem_signal(&done);
+  }
+}
+
+static void report(void) {
+  print_string("name,iterations,min,avg,max\r\n");
+  for (uint8_t i = 0; i < NUM_BENCHES; i++) {
+    struct bench_result* r = &results[i];
+    print_string(r->name);
+    print_string(",");
+    print_int(r->iterations);
+    print_string(",");
+    print_int32(r->min);
+    print_string(",");
+    print_int32(r->iterations ? r->total / r->iterations : 0);
+    print_string(",");
+    print_int32(r->max);
+    print_string("\r\n");
+  }
+}
+
+// runs each benchmark on both workers, waiting for them to finish
+static void controller(void* args) {
+  for (phase = 0; phase < BENCH_TICK_ISR; phase++) {
+    stampedBy = UINT8_MAX;
+    // set before either worker runs, as the spinner stops once it is clear
+    sleeping = phase == BENCH_SLEEP_WAKEUP;
+    sem_signal(&go[0]);
+    sem_signal(&go[1]);
+    sem_wait(&done);
+    sem_wait(&done);
+  }
+  report();
+  serial_flush();
+  hal_halt();
+}
+
+int main(int argc, char** argv) {
+  serial_init();
+  os_init();
+
+  sem_init(&go[0], 0);
+  sem_init(&go[1], 0);
+  sem_init(&done, 0);
+  sem_init(&ping, 0);
+  sem_init(&pong, 0);
+  mutex_init(&m);
+
+  create_thread("worker0", worker, (void*)0, 64, WORKER_PRIORITY);
+  create_thread("worker1", worker, (void*)1, 64, WORKER_PRIORITY);
+  create_thread("control", controller, 0, 64, WORKER_PRIORITY + 1);
+
+  os_start();
+  sei();
+
+  while (true) {
+    os_idle();
+  }
+  return 0;
+}
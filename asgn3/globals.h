@@ -1,5 +1,4 @@
 #pragma once
-#include <stdio.h>
 
 //place defines and prototypes here
 #define RED 31
@@ -12,11 +11,4 @@
 #define MAX_ROW 25
 #define MAX_COL 80
 
-#define print_fmt_buf(fmt_str, ...) \
-  const char *fmt = fmt_str; \
-  int sz = snprintf(NULL, 0, fmt, __VA_ARGS__); \
-  char buf[sz + 1]; \
-  snprintf(buf, sizeof buf, fmt, __VA_ARGS__); \
-  print_string(buf)
-
 
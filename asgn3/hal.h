@@ -0,0 +1,167 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+
+// Hardware abstraction layer. The kernel, the synchronization primitives and
+// the serial library only reach the hardware through the functions declared
+// here. hal_avr.c implements them for the ATmega2560 and hal_host.c on Linux
+// so the same scheduler can be run and debugged on a PC.
+
+struct thread_t;
+typedef void (*thread_func)(void*);
+
+#ifdef __AVR__
+#include <avr/interrupt.h>
+#include <avr/io.h>
+
+// This structure defines the register order pushed to the stack on a
+// system context switch. Only the registers the avr-gcc ABI makes callee
+// saved are kept, since context_switch is always entered through a call.
+struct regs_context_switch {
+  // stack pointer is pointing to 1 byte below the top of the stack
+  uint8_t padding;
+
+  // Registers that will be managed by the context switch function
+  uint8_t r29;
+  uint8_t r28;
+  uint8_t r17;
+  uint8_t r16;
+  uint8_t r15;
+  uint8_t r14;
+  uint8_t r13;
+  uint8_t r12;
+  uint8_t r11;
+  uint8_t r10;
+  uint8_t r9;
+  uint8_t r8;
+  uint8_t r7;
+  uint8_t r6;
+  uint8_t r5;
+  uint8_t r4;
+  uint8_t r3;
+  uint8_t r2;
+  uint8_t eind; // third byte of the PC
+  uint8_t pch;
+  uint8_t pcl;
+
+  // where the thread function returns to
+  uint8_t exitEind;
+  uint8_t exitPch;
+  uint8_t exitPcl;
+};
+
+// This structure defines how registers are pushed to the stack when the
+// system 10ms interrupt occurs: the call-clobbered registers and the state
+// registers, after which the interrupt calls os_tick. A preempted thread
+// therefore has this frame below a regs_context_switch frame, while a thread
+// that gave up the CPU voluntarily only has the regs_context_switch frame.
+// Both resume through the same context_switch. The receive interrupt can
+// also switch to a woken reader, and the compiler saves the same registers
+// for it, with a few bytes more for its deeper calls. This struct is never
+// directly used, but be sure to account for its size when allocating
+// initial stack space
+struct regs_interrupt {
+  // stack pointer is pointing to 1 byte below the top of the stack
+  uint8_t padding;
+
+  // RAMPZ and EIND are extended addressing registers of the ATmega2560
+  uint8_t eindReg; // EIND register
+  uint8_t rampz;   // RAMPZ register
+
+  // Registers that are pushed to the stack during an interrupt service routine
+  uint8_t r31;
+  uint8_t r30;
+  uint8_t r27;
+  uint8_t r26;
+  uint8_t r25;
+  uint8_t r24;
+  uint8_t r23;
+  uint8_t r22;
+  uint8_t r21;
+  uint8_t r20;
+  uint8_t r19;
+  uint8_t r18;
+
+  uint8_t r1;
+  uint8_t sreg; // status register
+  uint8_t r0;
+  uint8_t eind; // third byte of the PC
+  uint8_t pch;
+  uint8_t pcl;
+};
+
+// bytes needed on a new thread's stack besides what the thread itself uses
+#define HAL_STACK_OVERHEAD                                                     \
+  (sizeof(struct regs_interrupt) + sizeof(struct regs_context_switch))
+
+// Both system timers count at F_CPU / 1024 and clear on compare match, so a
+// tick is TICK_COMPARE + 1 timer counts and a second SECOND_COMPARE + 1.
+#define TICK_COMPARE 156
+#define SECOND_COMPARE 15625
+
+// rate of hal_clock(), the Timer0 count at the /1024 prescaler
+#define HAL_CLOCK_HZ (F_CPU / 1024)
+
+// trace timestamps: the tick count's low byte, then TCNT0 within the tick
+#define HAL_TRACE_SUBTICKS (TICK_COMPARE + 1)
+#define hal_trace_time() ((uint16_t)(uint8_t)isrCounterMilli << 8 | TCNT0)
+
+#ifdef OS_INSTRUMENT
+// CPU cycles, from Timer3 running at the CPU clock
+typedef uint16_t hal_cycles_t;
+#define cycle_count() TCNT3
+#endif
+
+#else // host
+
+// cli() and sei() block and unblock the signal that drives the system tick
+void cli(void);
+void sei(void);
+
+// room for a ucontext_t, the C library and nested signal handlers, while
+// keeping the total within the uint16_t stack size
+#define HAL_STACK_OVERHEAD 32768
+
+// hal_clock() counts microseconds on the host
+#define HAL_CLOCK_HZ 1000000UL
+// trace timestamps are just the low bits of the clock
+#define HAL_TRACE_SUBTICKS 0
+#define hal_trace_time() ((uint16_t)hal_clock())
+
+#ifdef OS_INSTRUMENT
+// nanoseconds on the host, 32 bits wide as 16 would wrap every 65 us
+typedef uint32_t hal_cycles_t;
+hal_cycles_t hal_cycle_count(void);
+#define cycle_count() hal_cycle_count()
+#endif
+
+#endif
+
+// Saves the current thread's context, stores its stack pointer in the old
+// thread, and resumes the new thread from its saved stack pointer. The stack
+// pointer is the first member of struct thread_t so that it can be reached
+// without any offset.
+void context_switch(struct thread_t* new_tp, struct thread_t* old_tp);
+void hal_init_main_thread(struct thread_t* t);
+void hal_init_stack(struct thread_t* t, thread_func function, void* args);
+// starts the interrupts that call os_tick() every 10 ms and os_second()
+// every second
+void hal_start_timers(void);
+// called by the idle thread with interrupts disabled when no thread is ready,
+// returns with interrupts disabled after at least one interrupt
+void hal_idle(void);
+// a free running count of HAL_CLOCK_HZ, finer than the tick, for measuring
+// run time; called with interrupts disabled
+uint32_t hal_clock(void);
+// stops the program for good; simavr exits when the CPU sleeps with
+// interrupts disabled
+void hal_halt(void);
+
+void hal_led(bool on);
+
+void hal_serial_init(void);
+// writes a byte by polling, for when the transmit interrupt can't be used
+void hal_serial_write(uint8_t b);
+// starts the transmit interrupt, which drains serial_tx_next() until it
+// runs out of bytes; called with interrupts disabled
+void hal_serial_tx_start(void);
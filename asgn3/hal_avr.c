@@ -0,0 +1,402 @@
+#include "hal.h"
+#include "os.h"
+#include "serial.h"
+#include <avr/interrupt.h>
+#include <avr/io.h>
+#include <avr/sleep.h>
+#include <string.h>
+
+#define mask_low(num) 0x00ff & (uint16_t)num
+#define mask_high(num) 0x00ff & ((uint16_t)num >> 8)
+
+/* Context switch will pop off the manually saved registers,
+ * then ret to thread_start. ret will pop off the automatically
+ * saved registers and thread_start will pop off the
+ * function address and then ijmp to the function.
+ *
+ * Only the callee-saved registers (r2-r17, r28, r29) are saved here. The
+ * caller has already saved anything else it needs, and a thread preempted by
+ * the system timer has its other registers in the interrupt's frame below.
+ * Each switch costs 36 pushes and pops (72 cycles) plus 16 cycles to swap
+ * the stack pointer and return.
+ */
+__attribute__((naked)) void context_switch(struct thread_t* new_tp,
+                                           struct thread_t* old_tp) {
+  // first we have to manually save the callee-saved registers
+  __asm__ volatile("push r2\n\t"
+                   "push r3\n\t"
+                   "push r4\n\t"
+                   "push r5\n\t"
+                   "push r6\n\t"
+                   "push r7\n\t"
+                   "push r8\n\t"
+                   "push r9\n\t"
+                   "push r10\n\t"
+                   "push r11\n\t"
+                   "push r12\n\t"
+                   "push r13\n\t"
+                   "push r14\n\t"
+                   "push r15\n\t"
+                   "push r16\n\t"
+                   "push r17\n\t"
+                   "push r28\n\t"
+                   "push r29\n\t");
+
+  // Save the current stack pointer straight into old_tp->stackPointer,
+  // which is at offset 0 (argument 2 is in r22/r23)
+  __asm__ volatile("movw r30, r22\n\t"
+                   "in r16, __SP_L__\n\t"
+                   "in r17, __SP_H__\n\t"
+                   "st z, r16\n\t"
+                   "std z+1, r17\n\t");
+
+  // Load the new stack pointer from new_tp->stackPointer (argument 1 is in
+  // r24/r25). Interrupts are always disabled here, so SP can be written a
+  // byte at a time
+  __asm__ volatile("movw r30, r24\n\t"
+                   "ld r16, z\n\t"
+                   "ldd r17, z+1\n\t"
+                   "out __SP_L__, r16\n\t"
+                   "out __SP_H__, r17\n\t");
+
+  // manually restore all registers
+  __asm__ volatile("pop r29\n\t"
+                   "pop r28\n\t"
+                   "pop r17\n\t"
+                   "pop r16\n\t"
+                   "pop r15\n\t"
+                   "pop r14\n\t"
+                   "pop r13\n\t"
+                   "pop r12\n\t"
+                   "pop r11\n\t"
+                   "pop r10\n\t"
+                   "pop r9\n\t"
+                   "pop r8\n\t"
+                   "pop r7\n\t"
+                   "pop r6\n\t"
+                   "pop r5\n\t"
+                   "pop r4\n\t"
+                   "pop r3\n\t"
+                   "pop r2\n\t"
+                   "ret\n\t");
+}
+
+__attribute__((naked)) void thread_start(void) {
+  sei(); // enable interrupts - leave as the first statement in thread_start()
+  __asm__ volatile("movw r30, r16\n\t"
+                   "movw r24, r14\n\t"
+                   "ijmp\n\t");
+}
+
+// the main thread runs on the stack set up by the C runtime
+void hal_init_main_thread(struct thread_t* t) {
+  t->highestStackAddress = (void*)0x8FF;
+}
+
+// Builds the frame that context_switch will pop when the thread is first
+// switched to: it returns into thread_start, which jumps to the function
+// with args as its first argument. Above it is a return address for the
+// function, so that returning from it calls thread_exit.
+void hal_init_stack(struct thread_t* t, thread_func function, void* args) {
+  struct regs_context_switch* regs =
+      ((struct regs_context_switch*)t->highestStackAddress) - 1;
+  memset(regs, 0, sizeof(*regs));
+  regs->pcl = mask_low(thread_start);
+  regs->pch = mask_high(thread_start);
+  regs->eind = 0;
+  regs->r14 = mask_low(args);
+  regs->r15 = mask_high(args);
+  regs->r16 = mask_low(function);
+  regs->r17 = mask_high(function);
+  regs->exitEind = 0;
+  regs->exitPch = mask_high(thread_exit);
+  regs->exitPcl = mask_low(thread_exit);
+
+  t->stackPointer = (uint8_t*)regs;
+}
+
+// This interrupt routine is automatically run every 10 milliseconds. It is
+// naked so that it pushes exactly struct regs_interrupt: just the
+// registers that os_tick may clobber and the state registers, with r1
+// cleared for C code. If os_tick switches threads, context_switch adds the
+// callee-saved registers on top, so a preempted thread is resumed by the
+// same context_switch as any other and then returns here to reti.
+ISR(TIMER0_COMPA_vect, ISR_NAKED) {
+  __asm__ volatile("push r0\n\t"
+                   "in r0, __SREG__\n\t"
+                   "push r0\n\t"
+                   "push r1\n\t"
+                   "clr r1\n\t"
+                   "push r18\n\t"
+                   "push r19\n\t"
+                   "push r20\n\t"
+                   "push r21\n\t"
+                   "push r22\n\t"
+                   "push r23\n\t"
+                   "push r24\n\t"
+                   "push r25\n\t"
+                   "push r26\n\t"
+                   "push r27\n\t"
+                   "push r30\n\t"
+                   "push r31\n\t"
+                   "in r0, 0x3b\n\t" // RAMPZ
+                   "push r0\n\t"
+                   "in r0, 0x3c\n\t" // EIND
+                   "push r0\n\t");
+
+  __asm__ volatile("call os_tick\n\t");
+
+  __asm__ volatile("pop r0\n\t"
+                   "out 0x3c, r0\n\t"
+                   "pop r0\n\t"
+                   "out 0x3b, r0\n\t"
+                   "pop r31\n\t"
+                   "pop r30\n\t"
+                   "pop r27\n\t"
+                   "pop r26\n\t"
+                   "pop r25\n\t"
+                   "pop r24\n\t"
+                   "pop r23\n\t"
+                   "pop r22\n\t"
+                   "pop r21\n\t"
+                   "pop r20\n\t"
+                   "pop r19\n\t"
+                   "pop r18\n\t"
+                   "pop r1\n\t"
+                   "pop r0\n\t"
+                   "out __SREG__, r0\n\t"
+                   "pop r0\n\t"
+                   "reti\n\t");
+}
+
+#if OS_TICKLESS
+// set while tickless_sleep has the tick stopped
+static volatile bool tickStopped = false;
+// the Timer1 count and second, and the partial tick, up to which a tickless
+// sleep has been credited to the tick counter
+static uint16_t sleepMark;
+static uint32_t sleepMarkSec;
+static uint16_t sleepOffset;
+
+// Credits the whole ticks slept since the mark to the tick counter and the
+// sleeping threads, and moves the mark up to now. wrapped says Timer1 has
+// wrapped but isrCounterSec has not counted the second yet. Called with
+// interrupts disabled.
+static void credit_sleep(bool wrapped) {
+  uint16_t now = TCNT1;
+  if (TIFR1 & _BV(OCF1A)) {
+    now = TCNT1;
+    wrapped = true;
+  }
+  uint32_t seconds = isrCounterSec - sleepMarkSec + wrapped;
+  uint32_t elapsed =
+      seconds * (SECOND_COMPARE + 1) + now - sleepMark + sleepOffset;
+  uint16_t ticks = elapsed / (TICK_COMPARE + 1);
+  isrCounterMilli += ticks;
+  update_sleeping_threads(ticks);
+
+  sleepMark = now;
+  sleepMarkSec = isrCounterSec + wrapped;
+  sleepOffset = elapsed % (TICK_COMPARE + 1);
+}
+
+// only used to wake the CPU from a tickless sleep
+EMPTY_INTERRUPT(TIMER1_COMPB_vect);
+#endif
+
+// This interrupt routine is run once a second. The ticks of a tickless sleep
+// are credited first, so that os_second reads an up to date clock.
+ISR(TIMER1_COMPA_vect) {
+#if OS_TICKLESS
+  if (tickStopped) {
+    credit_sleep(true);
+  }
+#endif
+  os_second();
+}
+
+void hal_start_timers(void) {
+
+  // start timer 0 for OS system interrupt
+  TIMSK0 |= _BV(OCIE0A); // interrupt on compare match
+  TCCR0A |= _BV(WGM01);  // clear timer on compare match
+
+  // Generate timer interrupt every ~10 milliseconds
+  TCCR0B |= _BV(CS02) | _BV(CS00); // prescalar /1024
+  OCR0A = TICK_COMPARE;            // generate interrupt every 9.98 milliseconds
+
+  // start timer 1 to generate interrupt every 1 second
+  OCR1A = SECOND_COMPARE;
+  TIMSK1 |= _BV(OCIE1A);                        // interrupt on compare
+  TCCR1B |= _BV(WGM12) | _BV(CS12) | _BV(CS10); // slowest prescalar /1024
+
+#ifdef OS_INSTRUMENT
+  // free running timer 3 at the CPU clock for cycle_count()
+  TCCR3A = 0;
+  TCCR3B = _BV(CS30); // no prescalar
+#endif
+
+  set_sleep_mode(SLEEP_MODE_IDLE); // timers keep running in idle mode
+}
+
+#if OS_TICKLESS
+/*
+ * Sleeps the CPU with the system tick stopped until the first sleeping
+ * thread is due, then credits the ticks that were skipped. Timer1 keeps
+ * running, so the wake-up deadline is set with its second compare unit. A
+ * deadline past the end of the current second is left to the once a second
+ * interrupt, after which the main thread simply idles again.
+ */
+static void tickless_sleep(void) {
+  sleepMark = TCNT1;
+  sleepMarkSec = isrCounterSec;
+  // Timer1 has wrapped but its interrupt has not counted the second yet, so
+  // it will count a wrap from before the mark
+  if (TIFR1 & _BV(OCF1A)) {
+    sleepMark = TCNT1;
+    sleepMarkSec++;
+  }
+
+  // stop the tick, keeping Timer0's partial count (and a tick that is
+  // pending but not yet serviced) as an offset into the current tick
+  TIMSK0 &= ~_BV(OCIE0A);
+  sleepOffset = TCNT0;
+  if (TIFR0 & _BV(OCF0A)) {
+    sleepOffset += TICK_COMPARE + 1;
+  }
+  if (sleepOffset > TICK_COMPARE) {
+    sleepOffset -= TICK_COMPARE + 1;
+    isrCounterMilli++;
+    update_sleeping_threads(1);
+  }
+  tickStopped = true;
+
+  if (sys->readyMask == 0) {
+    if (sys->sleepHead != NO_THREAD) {
+      uint32_t deadline = sleepMark - sleepOffset +
+                          (uint32_t)sys->threads[sys->sleepHead].sleepTicks *
+                              (TICK_COMPARE + 1);
+      if (deadline <= SECOND_COMPARE) {
+        OCR1B = deadline;
+        TIFR1 = _BV(OCF1B);
+        TIMSK1 |= _BV(OCIE1B);
+      }
+    }
+
+    // sei takes effect after the next instruction, so no interrupt can slip
+    // in between enabling interrupts and sleeping
+    sleep_enable();
+    sei();
+    sleep_cpu();
+    cli();
+    sleep_disable();
+    TIMSK1 &= ~_BV(OCIE1B);
+  }
+
+  // credit the rest of the sleep, after what the once a second interrupt may
+  // already have credited, allowing for a wrap it has not counted yet
+  credit_sleep(false);
+  tickStopped = false;
+
+  // restart the tick with the partial tick that was not credited
+  TCNT0 = sleepOffset;
+  TIFR0 = _BV(OCF0A);
+  TIMSK0 |= _BV(OCIE0A);
+}
+#endif
+
+void hal_idle(void) {
+#if OS_TICKLESS
+  tickless_sleep();
+#else
+  // sei takes effect after the next instruction, so no interrupt can slip in
+  // between enabling interrupts and sleeping
+  sleep_enable();
+  sei();
+  sleep_cpu();
+  cli();
+  sleep_disable();
+#endif
+}
+
+uint32_t hal_clock(void) {
+#if OS_TICKLESS
+  // Timer0 is stopped in a tickless sleep, which is credited up to the mark
+  if (tickStopped) {
+    return isrCounterMilli * (TICK_COMPARE + 1) + sleepOffset;
+  }
+#endif
+  uint8_t count = TCNT0;
+  uint32_t ticks = isrCounterMilli;
+  // Timer0 has wrapped but its interrupt has not counted the tick yet
+  if (TIFR0 & _BV(OCF0A)) {
+    count = TCNT0;
+    ticks++;
+  }
+  return ticks * (TICK_COMPARE + 1) + count;
+}
+
+void hal_halt(void) {
+  cli();
+  sleep_enable();
+  sleep_cpu();
+  while (true) {
+  }
+}
+
+void hal_led(bool on) {
+  uint8_t value = on ? 0x80 : 0x00;
+  // Clear Z high byte and set Z low byte to DDRB
+  // Write 0x80 to location 0x24 (set LED pin as output)
+  // Set Z low byte to the LED register (PORTB) and write the LED bit
+  __asm__ __volatile__("clr r31\n\t"
+                       "ldi r30, 0x24\n\t"
+                       "ldi r16, 0x80\n\t"
+                       "st Z, r16\n\t"
+                       "ldi r30, 0x25\n\t"
+                       "st Z, %0\n\t"
+                       :
+                       : "r"(value)
+                       : "r16", "r30", "r31", "memory");
+}
+
+/*
+ * Initialize the serial port.
+ */
+void hal_serial_init(void) {
+  uint16_t baud_setting;
+
+  UCSR0A = _BV(U2X0);
+  baud_setting = 16; //115200 baud
+
+  // assign the baud_setting
+  UBRR0H = baud_setting >> 8;
+  UBRR0L = baud_setting;
+
+  // enable transmit, and receive with its interrupt
+  UCSR0B |= (1 << TXEN0) | (1 << RXEN0) | (1 << RXCIE0);
+}
+
+// hands each received byte to the serial driver
+ISR(USART0_RX_vect) { serial_rx_byte(UDR0); }
+
+void hal_serial_write(uint8_t b) {
+  //loop until the send buffer is empty
+  while (!(UCSR0A & (1 << UDRE0))) {}
+
+  //write out the byte
+  UDR0 = b;
+}
+
+void hal_serial_tx_start(void) { UCSR0B |= _BV(UDRIE0); }
+
+// The data register is empty: send the next buffered byte, or stop the
+// interrupt once the buffer is drained.
+ISR(USART0_UDRE_vect) {
+  uint8_t b;
+  if (serial_tx_next(&b)) {
+    UDR0 = b;
+  } else {
+    UCSR0B &= ~_BV(UDRIE0);
+  }
+}
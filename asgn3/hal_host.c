@@ -0,0 +1,210 @@
+// Linux implementation of the hardware abstraction layer. Threads are
+// ucontexts running on their own stacks, the system tick is a SIGALRM
+// from setitimer, the serial receive interrupt is a SIGIO when stdin has
+// input, and "disabling interrupts" blocks those signals. The serial port is
+// stdin and stdout.
+#define _GNU_SOURCE
+#include "hal.h"
+#include "os.h"
+#include "serial.h"
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include <time.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+#define TICK_USEC 10000
+#define TICKS_PER_SECOND 100
+
+// what a thread's stack pointer points at while it is switched out
+struct host_frame {
+  ucontext_t context;
+  thread_func function;
+  void* args;
+};
+
+static ucontext_t mainContext;
+static uint8_t ticksThisSecond = 0;
+// stdin's file status flags before hal_serial_init, restored at exit
+static int stdinFlags;
+// the signals that stand in for interrupts
+static void interrupt_signals(sigset_t* set) {
+  sigemptyset(set);
+  sigaddset(set, SIGALRM);
+  sigaddset(set, SIGIO);
+}
+
+static void mask_interrupts(int how) {
+  sigset_t set;
+  interrupt_signals(&set);
+  sigprocmask(how, &set, NULL);
+}
+
+void cli(void) { mask_interrupts(SIG_BLOCK); }
+
+void sei(void) { mask_interrupts(SIG_UNBLOCK); }
+
+void context_switch(struct thread_t* new_tp, struct thread_t* old_tp) {
+  swapcontext((ucontext_t*)old_tp->stackPointer,
+              (ucontext_t*)new_tp->stackPointer);
+}
+
+// makecontext only passes ints, so the frame address arrives in two halves
+static void thread_start(unsigned int high, unsigned int low) {
+  struct host_frame* frame =
+      (struct host_frame*)(((uintptr_t)high << 16 << 16) | low);
+  sei();
+  frame->function(frame->args);
+  thread_exit();
+}
+
+// the main thread runs on the process stack
+void hal_init_main_thread(struct thread_t* t) {
+  t->stackPointer = &mainContext;
+  t->highestStackAddress = &mainContext;
+}
+
+void hal_init_stack(struct thread_t* t, thread_func function, void* args) {
+  uintptr_t top = (uintptr_t)t->highestStackAddress & ~(uintptr_t)15;
+  struct host_frame* frame = ((struct host_frame*)top) - 1;
+  frame->function = function;
+  frame->args = args;
+
+  getcontext(&frame->context);
+  frame->context.uc_stack.ss_sp = t->lowestStackAddress;
+  frame->context.uc_stack.ss_size = (uint8_t*)frame - t->lowestStackAddress;
+  frame->context.uc_link = NULL;
+  // threads start with interrupts disabled, as thread_start enables them
+  sigaddset(&frame->context.uc_sigmask, SIGALRM);
+  sigaddset(&frame->context.uc_sigmask, SIGIO);
+  makecontext(&frame->context, (void (*)(void))thread_start, 2,
+              (unsigned int)((uintptr_t)frame >> 16 >> 16),
+              (unsigned int)(uintptr_t)frame);
+
+  t->stackPointer = &frame->context;
+}
+
+// stands in for both timer interrupts
+static void tick_handler(int sig) {
+  if (++ticksThisSecond == TICKS_PER_SECOND) {
+    ticksThisSecond = 0;
+    os_second();
+  }
+  os_tick();
+}
+
+void hal_start_timers(void) {
+  struct sigaction action = {0};
+  action.sa_handler = tick_handler;
+  // like an ISR, the handler runs with interrupts disabled
+  interrupt_signals(&action.sa_mask);
+  action.sa_flags = SA_RESTART;
+  sigaction(SIGALRM, &action, NULL);
+
+  struct itimerval timer = {0};
+  timer.it_interval.tv_usec = TICK_USEC;
+  timer.it_value.tv_usec = TICK_USEC;
+  setitimer(ITIMER_REAL, &timer, NULL);
+}
+
+void hal_idle(void) {
+  // wait for the next tick with everything else still blocked
+  sigset_t waitMask;
+  sigprocmask(SIG_BLOCK, NULL, &waitMask);
+  sigdelset(&waitMask, SIGALRM);
+  sigdelset(&waitMask, SIGIO);
+  sigsuspend(&waitMask);
+}
+
+uint32_t hal_clock(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint32_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+#ifdef OS_INSTRUMENT
+hal_cycles_t hal_cycle_count(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint32_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+#endif
+
+void hal_halt(void) { exit(EXIT_SUCCESS); }
+
+// there is no LED on the host
+void hal_led(bool on) {}
+
+// whether stdin has input, or has reached its end, so a read won't block
+static bool input_ready(void) {
+  struct pollfd fd = {.fd = STDIN_FILENO, .events = POLLIN};
+  return poll(&fd, 1, 0) > 0;
+}
+
+// stands in for the receive interrupt, reading straight into the buffer
+static void input_handler(int sig) {
+  while (input_ready()) {
+    uint8_t* span;
+    uint8_t n = serial_rx_peek(&span);
+    if (n == 0) {
+      // full, so switch to a woken reader to empty it. serial_rx_commit
+      // leaves that to the main thread, which here loses nothing by it
+      reschedule();
+      n = serial_rx_peek(&span);
+    }
+    if (n == 0) {
+      // still full, so the byte is dropped
+      uint8_t b;
+      if (read(STDIN_FILENO, &b, 1) != 1) {
+        return;
+      }
+      serial_rx_byte(b);
+      continue;
+    }
+    ssize_t received = read(STDIN_FILENO, span, n);
+    if (received <= 0) {
+      return;
+    }
+    serial_rx_commit(received);
+  }
+}
+
+static void restore_stdin(void) { fcntl(STDIN_FILENO, F_SETFL, stdinFlags); }
+
+// stdin raises SIGIO when input arrives. It stays blocking, as on a terminal
+// it usually shares its flags with stdout, and input is polled for instead.
+void hal_serial_init(void) {
+  struct sigaction action = {0};
+  action.sa_handler = input_handler;
+  interrupt_signals(&action.sa_mask);
+  action.sa_flags = SA_RESTART;
+  sigaction(SIGIO, &action, NULL);
+
+  stdinFlags = fcntl(STDIN_FILENO, F_GETFL);
+  atexit(restore_stdin);
+  fcntl(STDIN_FILENO, F_SETOWN, getpid());
+  fcntl(STDIN_FILENO, F_SETFL, stdinFlags | O_ASYNC);
+}
+
+// write(2) directly, since a thread can be preempted inside stdio and
+// another thread switched in on the same process thread
+void hal_serial_write(uint8_t b) {
+  while (write(STDOUT_FILENO, &b, 1) != 1) {
+  }
+}
+
+// there is no transmit interrupt, so drain the buffer straight away, a run
+// of bytes per write(2)
+void hal_serial_tx_start(void) {
+  const uint8_t* span;
+  uint8_t n;
+  while ((n = serial_tx_peek(&span)) > 0) {
+    ssize_t sent = write(STDOUT_FILENO, span, n);
+    if (sent > 0) {
+      serial_tx_commit(sent);
+    }
+  }
+}
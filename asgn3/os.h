@@ -2,123 +2,179 @@
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
-// This structure defines the register order pushed to the stack on a
-// system context switch.
-struct regs_context_switch {
-  // stack pointer is pointing to 1 byte below the top of the stack
-  uint8_t padding;
-
-  // Registers that will be managed by the context switch function
-  uint8_t r17;
-  uint8_t r16;
-  uint8_t r15;
-  uint8_t r14;
-  uint8_t r13;
-  uint8_t r12;
-  uint8_t r11;
-  uint8_t r10;
-  uint8_t r9;
-  uint8_t r8;
-  uint8_t r7;
-  uint8_t r6;
-  uint8_t r5;
-  uint8_t r4;
-  uint8_t r3;
-  uint8_t r2;
-  uint8_t eind; // third byte of the PC
-  uint8_t pch;
-  uint8_t pcl;
-};
-
-// This structure defines how registers are pushed to the stack when
-// the system 10ms interrupt occurs.  This struct is never directly
-// used, but instead be sure to account for the size of this struct
-// when allocating initial stack space
-struct regs_interrupt {
-  // stack pointer is pointing to 1 byte below the top of the stack
-  uint8_t padding;
-
-  // Registers that are pushed to the stack during an interrupt service routine
-  uint8_t r31;
-  uint8_t r30;
-  uint8_t r29;
-  uint8_t r28;
-  uint8_t r27;
-  uint8_t r26;
-  uint8_t r25;
-  uint8_t r24;
-  uint8_t r23;
-  uint8_t r22;
-  uint8_t r21;
-  uint8_t r20;
-  uint8_t r19;
-  uint8_t r18;
-
-  // RAMPZ and SREG are 2 other state registers in the AVR architecture
-  uint8_t rampz; // RAMPZ register
-  uint8_t sreg;  // status register
-
-  uint8_t r0;
-  uint8_t r1;
-  uint8_t eind;
-  uint8_t pch;
-  uint8_t pcl;
-};
+#include "hal.h"
 
-// 7 "regular threads" allowed bc there is an implicit main thread
+// Threads in the thread table, including the implicit main thread, which
+// takes the last slot. Thread IDs are bytes, with NO_THREAD left over.
+#ifndef MAX_THREADS
 #define MAX_THREADS 8
-#define MAIN_THREAD_ID MAX_THREADS - 1
+#endif
+#if MAX_THREADS < 2 || MAX_THREADS > 255
+#error "MAX_THREADS must be from 2 to 255"
+#endif
+#define MAIN_THREAD_ID (MAX_THREADS - 1)
 #define MAX_NAME_LENGTH 10
-// yields the next threadId in a looping sequence
-#define next_thread_id() (sys->currentThreadId + 1) % sys->threadCount
+// Priority levels, 0 is the lowest. The main thread runs at PRIORITY_IDLE so
+// that it is only scheduled when no other thread is ready. The ready bitmap
+// is a uint8_t, so there can be at most 8 levels.
+#define NUM_PRIORITIES 8
+#define PRIORITY_IDLE 0
+#define PRIORITY_DEFAULT 3
+#define MAX_PRIORITY (NUM_PRIORITIES - 1)
+// When nothing but the main thread is ready, os_idle() stops the 10 ms tick,
+// wakes on Timer1 at the next sleep deadline and catches up the elapsed
+// ticks. Build with -DOS_TICKLESS=0 to keep the periodic tick while idle.
+#ifndef OS_TICKLESS
+#define OS_TICKLESS 1
+#endif
+// marks the end of a thread list or the absence of a thread
+#define NO_THREAD UINT8_MAX
+
+// Thread stacks are filled with STACK_PAINT when created. The lowest
+// STACK_CANARY_SIZE bytes must still hold it whenever the thread is
+// switched out, or the kernel halts with a stack overflow.
+#define STACK_PAINT 0xA5
+#define STACK_CANARY_SIZE 2
+
+// The bytes a thread with the given usable stack size needs, e.g. for
+// storage passed to create_thread_static.
+#define THREAD_STACK_SIZE(n) ((n) + HAL_STACK_OVERHEAD)
+// Stacks for create_thread come from a static pool of this many bytes, so
+// all kernel memory is allocated at link time.
+#ifndef OS_STACK_POOL_SIZE
+#define OS_STACK_POOL_SIZE ((MAX_THREADS - 1) * THREAD_STACK_SIZE(128))
+#endif
+
+// timeouts for blocking calls, in ticks
+#define NO_WAIT 0
+#define WAIT_FOREVER UINT16_MAX
+// results of a blocking call
+#define WAIT_OK 0
+#define WAIT_TIMEOUT -1
 
 enum thread_state {
   THREAD_RUNNING = 0,
   THREAD_READY,
   THREAD_SLEEPING,
-  THREAD_WAITING
+  THREAD_WAITING,
+  THREAD_FREE // an unused slot in the thread table
 };
 
 typedef enum thread_state thread_state;
-// This structure holds thread specific information
+struct mutex_t;
+
+// A circular doubly linked list of threads, linked through the next and prev
+// fields of struct thread_t. Pushing, popping and removing are all O(1).
+struct thread_list {
+  uint8_t head; // NO_THREAD if the list is empty
+};
+// The scheduling state of a thread, used on every switch, block and wake.
+// Its ID is its index in sys->threads. What only creating, reporting on or
+// ending a thread needs is in struct thread_info, keeping this small.
 struct thread_t {
-  uint8_t threadId;
+  void* stackPointer; // must stay first, see context_switch
+  uint8_t* lowestStackAddress; // its canary is checked at every switch
+  void* highestStackAddress;
+  struct thread_list* waitList; // list the thread is blocked in, if any
+  void* message; // message being passed to or from a blocked thread
+  struct mutex_t* blockedOn;   // mutex this thread is waiting for, if any
+  struct mutex_t* heldMutexes; // mutexes owned, linked through nextHeld
+  uint32_t runTime; // hal_clock() counts spent running, wrapping
+  // ticks remaining after the previous thread in the sleep queue wakes
+  uint16_t sleepTicks;
+  uint16_t schedCount;  // number of times per second thread is run
+  uint8_t state;        // a thread_state
+  uint8_t priority;     // effective priority, raised by priority inheritance
+  uint8_t basePriority; // priority assigned at creation
+  uint8_t next; // links into a circular thread_list, NO_THREAD if unlinked
+  uint8_t prev;
+  uint8_t sleepNext; // next thread in the sleep queue, NO_THREAD at the end
+  uint8_t sleepPrev;
+  int8_t waitStatus;   // WAIT_OK or WAIT_TIMEOUT when a blocking call returns
+  uint8_t waitFlags;   // events waited for, then the events that woke it
+  uint8_t waitOptions; // EVENT_* options of the event wait
+};
+
+// The rest of a thread's information, at the same index in sys->threadInfo
+struct thread_info {
   char threadName[MAX_NAME_LENGTH + 1];
-  uint16_t stackSize;
   uint16_t functionAddress;
-  uint8_t* lowestStackAddress;
-  void* highestStackAddress;
-  void* stackPointer;
-  thread_state state;
-  uint16_t schedCount; // number of times per second thread is run
+  uint16_t stackSize;
   uint16_t prevSchedCount;
-  uint16_t sleepTicks;
+  uint32_t runTimeMark; // runTime at the start of the current second
+  uint8_t cpuLoad;      // percentage of the last second spent running
+  struct thread_list joinWaiters; // threads waiting for this one to exit
 };
 
 // This structure holds system information
 struct system_t {
   struct thread_t threads[MAX_THREADS];
+  struct thread_info threadInfo[MAX_THREADS];
+  struct thread_list freeThreads; // unused slots, reused oldest first
+  // one FIFO of ready threads per priority level; the running thread is not
+  // kept in any ready queue
+  struct thread_list readyQueues[NUM_PRIORITIES];
+  uint8_t readyMask; // bit n is set when readyQueues[n] is not empty
+  // Sleeping threads ordered by wake time. Each sleepTicks is relative to
+  // the thread before it, so a tick only decrements the head.
+  uint8_t sleepHead;
   uint8_t currentThreadId;
-  uint8_t threadCount;
-  uint32_t elapsedTime;
+  uint8_t threadCount; // threads created and not yet exited, besides main
+  bool started;        // os_start has been called
+  uint32_t switchCount; // context switches since os_start
+  uint32_t elapsedTime; // seconds since os_start
+  uint32_t switchTime;  // hal_clock() when the current thread was switched in
+  uint32_t secondTime;  // hal_clock() at the start of the current second
 };
 
 
 
+// Cycle-count instrumentation. Building with -DOS_INSTRUMENT makes the HAL
+// provide cycle_count() so that sections of the kernel can be timed. On the
+// AVR it reads Timer3 running at the CPU clock, which wraps every 65536
+// cycles (4 ms at 16 MHz), plenty for anything run with interrupts disabled.
+// Counts are hal_cycles_t, which is wider on the host.
+#ifdef OS_INSTRUMENT
+extern volatile hal_cycles_t tickCycles;    // duration of the last tick ISR
+extern volatile hal_cycles_t tickCyclesMax; // longest tick ISR so far
+extern volatile uint32_t tickInterrupts;    // tick ISRs actually taken
+extern volatile hal_cycles_t tickStart;     // when the last tick ISR began
+#endif
+
 extern volatile struct system_t* sys;
 extern volatile uint32_t isrCounterMilli;
 extern volatile uint32_t isrCounterSec;
 
 void init_main_thread(void);
 void os_init(void);
-uint8_t next_thread_in_seq();
+void thread_list_init(struct thread_list* l);
+void thread_list_push(struct thread_list* l, uint8_t threadId);
+uint8_t thread_list_pop(struct thread_list* l);
+void thread_list_remove(struct thread_list* l, uint8_t threadId);
+void thread_list_insert_prio(struct thread_list* l, uint8_t threadId);
+void make_ready(uint8_t threadId);
+void set_priority(uint8_t threadId, uint8_t priority);
+void reschedule(void);
+int8_t thread_block(struct thread_list* l, uint16_t timeout, bool byPriority);
+void thread_wake(uint8_t threadId);
+uint8_t wake_first(struct thread_list* l);
 uint8_t get_next_thread(void);
-void update_sleeping_threads(void);
+void update_sleeping_threads(uint16_t ticks);
 void thread_sleep(uint16_t ticks);
 void yield(void);
-void create_thread(char* name, uint16_t address, void* args,
-                   uint16_t stack_size);
+void os_idle(void);
+void os_tick(void);
+void os_second(void);
+uint8_t create_thread(char* name, thread_func function, void* args,
+                      uint16_t stack_size, uint8_t priority);
+uint8_t create_thread_static(char* name, thread_func function, void* args,
+                             uint8_t* stack, uint16_t stackSize,
+                             uint8_t priority);
+
+void thread_exit(void);
+int8_t thread_join(uint8_t threadId, uint16_t timeout);
 
 void os_start(void);
+uint16_t thread_stack_peak(uint8_t threadId);
 void switch_to_thread(uint8_t threadId);
 void switch_next_thread(void);
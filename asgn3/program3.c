@@ -1,136 +1,142 @@
 #include "program3.h"
 #include "globals.h"
+#include "hal.h"
 #include "os.h"
 #include "serial.h"
+#include "screen.h"
 #include "synchro.h"
-#include <avr/interrupt.h>
+#include "telemetry.h"
+#include "timer.h"
+#include "trace.h"
 #include <stdbool.h>
-#include <util/delay.h>
 
-static struct semaphore_t s;
-static struct mutex_t m;
-static size_t bufSize = 0;
+static struct mqueue_t buffer;
+static void* bufferSlots[MAX_BUFFER_SIZE];
+// items in flight: a full buffer, one blocked in the producer and one being
+// consumed
+static uint16_t items[MAX_BUFFER_SIZE + 2];
+static uint16_t lastItem = 0;
+// tells the display threads when there is something new to show
+static struct event_group_t changes;
+static struct timer_t blinkTimer;
 
 static uint16_t productionRate = DEFAULT_PRODUCE_TICKS;
 static uint16_t consumptionRate = DEFAULT_CONSUME_TICKS;
+// send binary telemetry instead of drawing the screen
+static volatile bool telemetryMode = false;
+
+// Sends a telemetry sample with the screen locked. A frame can wait for
+// room in the transmit buffer partway through, and a screen flush in the
+// meantime would corrupt it.
+static void send_sample(void) {
+  screen_lock();
+  telemetry_send();
+  screen_unlock();
+}
+
 /*
- * Prints the following information:
+ * Once a second, sends a telemetry sample in telemetry mode, or otherwise
+ * draws the following information:
  * 1. System time (in seconds)
- * 2. Number of threads in the system
- * 3. Per-thread information:
+ * 2. Number of threads in the system and the CPU idle time
+ * 3. A table of per-thread information:
  *   - thread id
  *   - thread name
+ *   - thread priority
+ *   - CPU load (percentage of the last second spent running)
  *   - thread pc (starting pc)
  *   - stack usage (number of bytes used by the stack)
+ *   - peak stack usage (most bytes the stack has ever used)
  *   - total stack size (number of bytes allocated for the stack)
  *   - current top of stack (current top of stack address)
  *   - stack base (lowest possible stack address)
  *   - stack end (highest possible stack address)
  */
 void display_stats(void) {
-  clear_screen();
+  screen_print(1, 1, MAGENTA, "Elapsed system time:");
+  screen_print(2, 1, MAGENTA, "Thread count:");
+  screen_print(2, 20, MAGENTA, "Context switches:");
+  screen_print(3, 1, MAGENTA, "CPU idle:");
+#ifdef OS_INSTRUMENT
+  screen_print(4, 1, MAGENTA, "Tick ISR cycles (last/max):");
+  screen_print(5, 1, MAGENTA, "Ticks elapsed/tick interrupts:");
+#endif
+  screen_print(STATS_TABLE_ROW, 1, WHITE,
+               "ID Name       Pri Load PC     Stack Peak  Size  "
+               "Top    Base   End");
 
   while (true) {
-
-    handleInput();
-    set_cursor(1, 1);
-
-    set_color(MAGENTA);
-
-    // System time
-    print_string("Elapsed system time: ");
-    print_int32(sys->elapsedTime);
-    print_string("s\r\n");
-
-    // Number of threads in the system
-
-    print_string("Thread count: ");
-    print_int(sys->threadCount);
-    print_string("\r\n\n");
-
-    // Per-thread information
-    for (size_t i = 0; i < sys->threadCount; i++) {
-      set_color(WHITE);
-      print_string("Thread ID: ");
-      print_int(sys->threads[i].threadId);
-      print_string("\r\n");
-
-      print_string("Thread Name: ");
-      print_string(sys->threads[i].threadName);
-      print_string("\r\n");
-
-      print_string("Thread PC: ");
-      print_hex(sys->threads[i].functionAddress);
-      print_string("\r\n");
-
-      print_string("Stack usage: ");
-      print_int((uint16_t)(sys->threads[i].highestStackAddress -
-                           sys->threads[i].stackPointer));
-      print_string("\r\n");
-
-      print_string("Total stack size: ");
-      print_int(sys->threads[i].stackSize);
-      print_string("\r\n");
-
-      print_string("Current top of stack: ");
-      print_hex((uint16_t)sys->threads[i].stackPointer);
-      print_string("\r\n");
-
-      print_string("Stack base: ");
-      print_hex((uint16_t)sys->threads[i].highestStackAddress);
-      print_string("\r\n");
-
-      print_string("Stack end: ");
-      print_hex((uint16_t)sys->threads[i].lowestStackAddress);
-      print_string("\r\n\n");
+    if (telemetryMode) {
+      send_sample();
+      event_wait(&sysEvents, SYS_EVENT_SECOND, EVENT_CLEAR, NULL,
+                 WAIT_FOREVER);
+      continue;
+    }
+    uint8_t col = screen_print_int32(1, 22, MAGENTA, sys->elapsedTime, 0);
+    screen_print(1, col, MAGENTA, "s");
+    screen_print_int(2, 15, MAGENTA, sys->threadCount, 4);
+    screen_print_int32(2, 38, MAGENTA, sys->switchCount, 10);
+    // the main thread is the idle thread
+    col = screen_print_int(3, 11, MAGENTA,
+                           sys->threadInfo[MAIN_THREAD_ID].cpuLoad, 0);
+    screen_print_field(3, col, MAGENTA, "%", 3);
+#ifdef OS_INSTRUMENT
+    col = screen_print_int32(4, 29, MAGENTA, tickCycles, 0);
+    col = screen_print(4, col, MAGENTA, "/");
+    screen_print_int32(4, col, MAGENTA, tickCyclesMax, 10);
+    col = screen_print_int32(5, 32, MAGENTA, isrCounterMilli, 0);
+    col = screen_print(5, col, MAGENTA, "/");
+    screen_print_int32(5, col, MAGENTA, tickInterrupts, 11);
+#endif
+
+    // one row per thread, as many as fit above the buffer, then blank rows
+    uint8_t row = STATS_TABLE_ROW + 1;
+    for (uint8_t i = 0; i < MAIN_THREAD_ID && row < BUFFER_ROW - 1; i++) {
+      volatile struct thread_t* t = &sys->threads[i];
+      volatile struct thread_info* info = &sys->threadInfo[i];
+      if (t->state == THREAD_FREE) {
+        continue;
+      }
+      screen_print_int(row, 1, WHITE, i, 3);
+      screen_print_field(row, 4, WHITE, (char*)info->threadName, 11);
+      screen_print_int(row, 15, WHITE, t->priority, 4);
+      uint8_t col = screen_print_int(row, 19, WHITE, info->cpuLoad, 0);
+      screen_print_field(row, col, WHITE, "%", 23 - col);
+      screen_print_hex(row, 24, WHITE, info->functionAddress, 7);
+      screen_print_int(row, 31, WHITE,
+                       (uint8_t*)t->highestStackAddress -
+                           (uint8_t*)t->stackPointer,
+                       6);
+      screen_print_int(row, 37, WHITE, thread_stack_peak(i), 6);
+      screen_print_int(row, 43, WHITE, info->stackSize, 6);
+      screen_print_hex(row, 49, WHITE, (uintptr_t)t->stackPointer, 7);
+      screen_print_hex(row, 56, WHITE, (uintptr_t)t->highestStackAddress, 7);
+      screen_print_hex(row, 63, WHITE, (uintptr_t)t->lowestStackAddress, 7);
+      row++;
     }
+    for (; row < BUFFER_ROW - 1; row++) {
+      screen_print_field(row, 1, WHITE, "", STATS_TABLE_WIDTH);
+    }
+    screen_flush();
+
+    // redraw once a second
+    event_wait(&sysEvents, SYS_EVENT_SECOND, EVENT_CLEAR, NULL, WAIT_FOREVER);
   }
 }
 
-void led_on(void) {
-  // Set data direction to OUTPUT
-  // Clear Z high byte
-  __asm__ __volatile__("clr r31");
-  // Set Z low byte to DDRB
-  __asm__ __volatile__("ldi r30, 0x24");
-  // Set 0x20 (DDRB bit 5 to 1)
-  __asm__ __volatile__("ldi r16, 0x80");
-  // Write 0x20 to location 0x24 (set LED pin as output)
-  __asm__ __volatile__("st Z, r16");
-
-  // Set LED to ON
-  // Set Z low byte to LED register
-  __asm__ __volatile__("ldi r30, 0x25");
-
-  __asm__ __volatile__("ldi r16, 0x80");
-  __asm__ __volatile__("st Z, r16");
-}
+void led_on(void) { hal_led(true); }
 
-void led_off(void) {
-  // Set data direction to OUTPUT
-  // Clear Z high byte
-  __asm__ __volatile__("clr r31");
-  // Set Z low byte to DDRB
-  __asm__ __volatile__("ldi r30, 0x24");
-  // Set 0x20 (DDRB bit 5 to 1)
-  __asm__ __volatile__("ldi r16, 0x80");
-  // Write 0x20 to location 0x24 (set LED pin as output)
-  __asm__ __volatile__("st Z, r16");
-
-  // Set LED to OFF
-  __asm__ __volatile__("ldi r30, 0x25");
-
-  __asm__ __volatile__("ldi r16, 0x00");
-  __asm__ __volatile__("st Z, r16");
-}
+void led_off(void) { hal_led(false); }
 
-void blink(void) {
-  while (true) {
-    if (bufSize < MAX_BUFFER_SIZE && productionRate > 0) {
-      led_on();
-    } else {
-      led_off();
-    }
+// Runs on the timer thread. The LED blinks while the producer has room in
+// the buffer and stays off while it is full or production is stopped.
+void blink(void* args) {
+  static bool lit = false;
+  lit = !lit && mq_count(&buffer) < MAX_BUFFER_SIZE && productionRate > 0;
+  if (lit) {
+    led_on();
+  } else {
+    led_off();
   }
 }
 
@@ -138,20 +144,38 @@ int main(int argc, char** argv) {
   serial_init();
   os_init();
 
-  create_thread("producer", (uint16_t)producer, 0, 50);
-  create_thread("consumer", (uint16_t)consumer, 0, 51);
-  create_thread("stats", (uint16_t)display_stats, 0, 52);
-  create_thread("buf_viz", (uint16_t)display_bounded_buffer, 0, 53);
-  create_thread("blink", (uint16_t)blink, 0, 54);
-
-  sem_init(&s, 1);
-  mutex_init(&m);
-
-  clear_screen();
+  // The display threads only wake when there is something new to show.
+  // Each stack has room for the thread's deepest calls, e.g. stats blocking
+  // on the screen lock inside screen_print_field, or input waiting for room
+  // in the transmit buffer inside a telemetry frame, plus a tick preempting
+  // it there, which needs about 80 bytes more for the ISR and the switch.
+  // The Peak column of the stats table shows how much each one has used.
+  create_thread("producer", (thread_func)producer, 0, 128,
+                PRIORITY_DEFAULT + 1);
+  create_thread("consumer", (thread_func)consumer, 0, 128,
+                PRIORITY_DEFAULT + 1);
+  create_thread("stats", (thread_func)display_stats, 0, 192,
+                PRIORITY_IDLE + 1);
+  create_thread("buf_viz", (thread_func)display_bounded_buffer, 0, 160,
+                PRIORITY_DEFAULT);
+  // input outranks the rest so that it takes keys as they arrive
+  create_thread("input", (thread_func)handleInput, 0, 192,
+                PRIORITY_DEFAULT + 2);
+  timers_init();
+
+  mq_init(&buffer, bufferSlots, MAX_BUFFER_SIZE);
+  event_init(&changes);
+  timer_init(&blinkTimer, blink, NULL);
+  timer_start(&blinkTimer, BLINK_TICKS, BLINK_TICKS);
+
+  screen_init();
+  telemetry_init();
   os_start();
   sei();
 
+  // the main thread is the idle thread
   while (true) {
+    os_idle();
   }
   return 0;
 }
@@ -159,93 +183,118 @@ int main(int argc, char** argv) {
 // simulate producing an item and placing an item in the buffer
 // default to 1 item per 1000 ms
 void producer(void) {
+  uint8_t next = 0;
+  uint16_t serial = 0;
   while (true) {
     thread_sleep(productionRate);
 
-    if (bufSize < MAX_BUFFER_SIZE) {
-      mutex_lock(&m);
-      sem_wait(&s);
-
-      bufSize++;
-
-      sem_signal(&s);
-      mutex_unlock(&m);
+    items[next] = ++serial;
+    mq_send(&buffer, &items[next], WAIT_FOREVER);
+    event_set(&changes, CHANGED_BUFFER);
+    if (++next == MAX_BUFFER_SIZE + 2) {
+      next = 0;
     }
   }
 }
 
 void consumer(void) {
+  void* item;
   while (true) {
     thread_sleep(consumptionRate);
 
-    if (bufSize > 0) {
-      mutex_lock(&m);
-      sem_wait(&s);
-
-      bufSize--;
-
-      sem_signal(&s);
-      mutex_lock(&m);
-    }
+    mq_receive(&buffer, &item, WAIT_FOREVER);
+    lastItem = *(uint16_t*)item;
+    event_set(&changes, CHANGED_BUFFER);
   }
 }
 
+// Draws the rates, the last item consumed, and the buffer's slots in a row
+// with the filled ones marked, whenever any of them change.
 void display_bounded_buffer(void) {
+  screen_print(BUFFER_ROW, 1, MAGENTA, "Producing 1 item per");
+  screen_print(BUFFER_ROW + 1, 1, MAGENTA, "Consuming 1 item per");
+  screen_print(BUFFER_ROW + 2, 1, MAGENTA, "Last item consumed:");
   while (true) {
-         set_cursor(1, 81);
-      set_color(MAGENTA);
-      print_string("Producing 1 item per ");
-      print_int(productionRate * 10);
-      print_string(" ms   ");
-
-      set_cursor(2, 81);
-      print_string("Consuming 1 item per ");
-      print_int(consumptionRate * 10);
-      print_string(" ms   ");
-
-      for (size_t i = 0; i < MAX_BUFFER_SIZE; i++) {
-         set_color(RED + (i % (WHITE - RED)));
-         set_cursor(3 + MAX_BUFFER_SIZE - i, 91);
-
-         if (i < bufSize) {
-            print_string("[o]");
-         }
-         else {
-            print_string("[ ]");
-         }
-      }
+    uint8_t col =
+        screen_print_int32(BUFFER_ROW, 22, MAGENTA, productionRate * 10UL, 0);
+    screen_print_field(BUFFER_ROW, col, MAGENTA, " ms", 9);
+    col = screen_print_int32(BUFFER_ROW + 1, 22, MAGENTA,
+                             consumptionRate * 10UL, 0);
+    screen_print_field(BUFFER_ROW + 1, col, MAGENTA, " ms", 9);
+    screen_print_int(BUFFER_ROW + 2, 21, MAGENTA, lastItem, 5);
+
+    uint8_t count = mq_count(&buffer);
+    for (uint8_t i = 0; i < MAX_BUFFER_SIZE; i++) {
+      screen_print(BUFFER_ROW + 3, 1 + 3 * i, RED + (i % (WHITE - RED)),
+                   i < count ? "[o]" : "[ ]");
+    }
+    // keep the screen up to date for when telemetry mode ends
+    if (!telemetryMode) {
+      screen_flush();
+    }
 
-      thread_sleep(5);
+    event_wait(&changes, CHANGED_BUFFER, EVENT_CLEAR, NULL, WAIT_FOREVER);
   }
 }
 
-void handleInput() {
-  uint8_t key = read_byte();
-  if (key == 255) {
-    return;
+// repaints the screen over binary output, unless in telemetry mode
+static void repaint(void) {
+  if (!telemetryMode) {
+    screen_redraw();
+    screen_flush();
   }
-  switch (key) {
-  case 'a':
-    if (productionRate < UINT16_MAX) {
-      productionRate++;
-    }
-    break;
-  case 'z':
-    if (productionRate > 0) {
-      productionRate--;
-    }
-    break;
-  case 'k':
-    if (consumptionRate < UINT16_MAX) {
-      consumptionRate++;
-    }
-    break;
-  case 'm':
-    if (consumptionRate > 0) {
-      consumptionRate--;
+}
+
+// waits for keys that change the rates, switch between the screen and
+// telemetry, or ask for a telemetry sample
+void handleInput(void) {
+  uint8_t key;
+  while (true) {
+    read_byte(&key, WAIT_FOREVER);
+    switch (key) {
+    case 'a':
+      if (productionRate < UINT16_MAX) {
+        productionRate++;
+      }
+      break;
+    case 'z':
+      if (productionRate > 0) {
+        productionRate--;
+      }
+      break;
+    case 'k':
+      if (consumptionRate < UINT16_MAX) {
+        consumptionRate++;
+      }
+      break;
+    case 'm':
+      if (consumptionRate > 0) {
+        consumptionRate--;
+      }
+      break;
+    case 'b':
+      telemetryMode = true;
+      continue;
+    case 'v':
+      telemetryMode = false;
+      repaint();
+      continue;
+    case 's':
+      send_sample();
+      repaint();
+      continue;
+#ifdef OS_TRACE
+    case 't':
+      // likewise keep the screen out of the middle of the dump
+      screen_lock();
+      trace_dump();
+      screen_unlock();
+      repaint();
+      continue;
+#endif
+    default:
+      continue;
     }
-    break;
-  default:
-    break;
+    event_set(&changes, CHANGED_BUFFER);
   }
 }
@@ -6,10 +6,21 @@
 #define DEFAULT_PRODUCE_TICKS 100
 #define MAX_BUFFER_SIZE 10
 
+// how long the LED stays on or off while blinking
+#define BLINK_TICKS 25
+
+// set on the display event group whenever the buffer or the rates change
+#define CHANGED_BUFFER 0x01
+
+// where the thread table and the buffer view start on the screen
+#define STATS_TABLE_ROW 7
+#define BUFFER_ROW 19
+#define STATS_TABLE_WIDTH 70
+
 int main(int argc, char ** argv);
 void led_on(void);
 void led_off(void);
-void blink(void);
+void blink(void* args);
 void handleInput(void);
 void producer(void);
 void consumer(void);
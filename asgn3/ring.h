@@ -0,0 +1,147 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+// Single producer, single consumer ring buffers. RING_DEFINE(name, type,
+// size) defines struct name, holding size elements of type, and its
+// functions:
+//
+//   void name_init(struct name* r)
+//   bool name_put(struct name* r, type v)   false if full, v is not stored
+//   bool name_get(struct name* r, type* v)  false if empty
+//   uint8_t name_count(struct name* r)
+//   bool name_empty(struct name* r)
+//   bool name_full(struct name* r)
+//
+// and for moving several elements at once:
+//
+//   uint8_t name_put_n(struct name* r, const type* src, uint8_t n)
+//   uint8_t name_get_n(struct name* r, type* dst, uint8_t n)
+//     copy up to n elements in at most two memcpy calls, returning how many
+//   type* name_put_peek(struct name* r, uint8_t* n)
+//   void name_put_commit(struct name* r, uint8_t n)
+//     the free space that follows on in memory, *n elements long, for the
+//     producer to fill in place, then commit the n elements written
+//   type* name_get_peek(struct name* r, uint8_t* n)
+//   void name_get_commit(struct name* r, uint8_t n)
+//     likewise the buffered elements that follow on in memory, and commit
+//     the n elements used to free them
+//
+// A full ring rejects puts rather than overwrite the oldest element, which
+// the consumer may be reading. Callers that must not lose data block on a
+// thread_list until the consumer makes room, as write_byte does.
+//
+// One side may be an interrupt handler and the other a thread without
+// disabling interrupts: only the producer writes head and only the consumer
+// writes tail, each after its elements are copied, and both are single
+// bytes, so they are read and written atomically on the AVR. The indexes run
+// freely and are masked on access, so size must be a power of two, and at
+// most 128 for head - tail to count a full ring. With more than one producer
+// or consumer, they must hold interrupts off around each call.
+
+// keeps the compiler from moving element copies past an index update
+#define RING_BARRIER() __asm__ __volatile__("" ::: "memory")
+
+#define RING_DEFINE(name, type, size)                                          \
+  typedef char name##_size_check                                               \
+      [((size) & ((size)-1)) == 0 && (size) <= 128 ? 1 : -1];                  \
+                                                                               \
+  struct name {                                                                \
+    type data[size];                                                           \
+    volatile uint8_t head; /* next to put, written by the producer */         \
+    volatile uint8_t tail; /* next to get, written by the consumer */         \
+  };                                                                           \
+                                                                               \
+  static inline void name##_init(struct name* r) {                             \
+    r->head = 0;                                                               \
+    r->tail = 0;                                                               \
+  }                                                                            \
+                                                                               \
+  static inline uint8_t name##_count(struct name* r) {                         \
+    return (uint8_t)(r->head - r->tail);                                       \
+  }                                                                            \
+                                                                               \
+  static inline bool name##_empty(struct name* r) {                            \
+    return r->head == r->tail;                                                 \
+  }                                                                            \
+                                                                               \
+  static inline bool name##_full(struct name* r) {                             \
+    return name##_count(r) == (size);                                          \
+  }                                                                            \
+                                                                               \
+  static inline bool name##_put(struct name* r, type v) {                      \
+    uint8_t head = r->head;                                                    \
+    if ((uint8_t)(head - r->tail) == (size)) {                                 \
+      return false;                                                            \
+    }                                                                          \
+    r->data[head & ((size)-1)] = v;                                            \
+    RING_BARRIER();                                                            \
+    r->head = head + 1;                                                        \
+    return true;                                                               \
+  }                                                                            \
+                                                                               \
+  static inline bool name##_get(struct name* r, type* v) {                     \
+    uint8_t tail = r->tail;                                                    \
+    if (r->head == tail) {                                                     \
+      return false;                                                            \
+    }                                                                          \
+    RING_BARRIER();                                                            \
+    *v = r->data[tail & ((size)-1)];                                           \
+    RING_BARRIER();                                                            \
+    r->tail = tail + 1;                                                        \
+    return true;                                                               \
+  }                                                                            \
+                                                                               \
+  static inline type* name##_put_peek(struct name* r, uint8_t* n) {            \
+    uint8_t head = r->head;                                                    \
+    uint8_t space = (size) - (uint8_t)(head - r->tail);                        \
+    uint8_t run = (size) - (head & ((size)-1));                                \
+    *n = space < run ? space : run;                                            \
+    return &r->data[head & ((size)-1)];                                        \
+  }                                                                            \
+                                                                               \
+  static inline void name##_put_commit(struct name* r, uint8_t n) {            \
+    RING_BARRIER();                                                            \
+    r->head += n;                                                              \
+  }                                                                            \
+                                                                               \
+  static inline type* name##_get_peek(struct name* r, uint8_t* n) {            \
+    uint8_t tail = r->tail;                                                    \
+    uint8_t count = r->head - tail;                                            \
+    uint8_t run = (size) - (tail & ((size)-1));                                \
+    *n = count < run ? count : run;                                            \
+    RING_BARRIER();                                                            \
+    return &r->data[tail & ((size)-1)];                                        \
+  }                                                                            \
+                                                                               \
+  static inline void name##_get_commit(struct name* r, uint8_t n) {            \
+    RING_BARRIER();                                                            \
+    r->tail += n;                                                              \
+  }                                                                            \
+                                                                               \
+  static inline uint8_t name##_put_n(struct name* r, const type* src,          \
+                                     uint8_t n) {                              \
+    uint8_t head = r->head;                                                    \
+    uint8_t space = (size) - (uint8_t)(head - r->tail);                        \
+    uint8_t run = (size) - (head & ((size)-1));                                \
+    n = n < space ? n : space;                                                 \
+    run = n < run ? n : run;                                                   \
+    memcpy(&r->data[head & ((size)-1)], src, run * sizeof(type));              \
+    memcpy(r->data, src + run, (n - run) * sizeof(type));                      \
+    name##_put_commit(r, n);                                                   \
+    return n;                                                                  \
+  }                                                                            \
+                                                                               \
+  static inline uint8_t name##_get_n(struct name* r, type* dst, uint8_t n) {   \
+    uint8_t tail = r->tail;                                                    \
+    uint8_t count = r->head - tail;                                            \
+    uint8_t run = (size) - (tail & ((size)-1));                                \
+    n = n < count ? n : count;                                                 \
+    run = n < run ? n : run;                                                   \
+    RING_BARRIER();                                                            \
+    memcpy(dst, &r->data[tail & ((size)-1)], run * sizeof(type));              \
+    memcpy(dst + run, r->data, (n - run) * sizeof(type));                      \
+    name##_get_commit(r, n);                                                   \
+    return n;                                                                  \
+  }
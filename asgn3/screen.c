@@ -0,0 +1,196 @@
+#include "screen.h"
+#include "globals.h"
+#include "serial.h"
+#include "synchro.h"
+#include <stdbool.h>
+#include <string.h>
+
+#define BLACK 30
+// no row is dirty
+#define CLEAN UINT8_MAX
+
+// what the screen should show
+static char cells[MAX_ROW][MAX_COL];
+// each cell's color less BLACK, two cells a byte
+static uint8_t colors[MAX_ROW][MAX_COL / 2];
+// the columns of each row that may differ from the terminal, dirtyLow is
+// CLEAN if none do
+static uint8_t dirtyLow[MAX_ROW];
+static uint8_t dirtyHigh[MAX_ROW];
+// where the terminal's cursor is and what color it is printing in, 0 when
+// unknown
+static uint8_t cursorRow;
+static uint8_t cursorCol;
+static uint8_t currentColor;
+// held while drawing or flushing
+static struct mutex_t screenLock;
+
+static uint8_t cell_color(uint8_t row, uint8_t col) {
+  uint8_t pair = colors[row][col / 2];
+  return BLACK + (col & 1 ? pair >> 4 : pair & 0x0F);
+}
+
+static void set_cell(uint8_t row, uint8_t col, char c, uint8_t color) {
+  // spaces look the same in any color
+  if (cells[row][col] == c && (c == ' ' || cell_color(row, col) == color)) {
+    return;
+  }
+  cells[row][col] = c;
+  uint8_t* pair = &colors[row][col / 2];
+  if (col & 1) {
+    *pair = (*pair & 0x0F) | (color - BLACK) << 4;
+  } else {
+    *pair = (*pair & 0xF0) | (color - BLACK);
+  }
+  if (dirtyLow[row] == CLEAN) {
+    dirtyLow[row] = col;
+    dirtyHigh[row] = col;
+  } else if (col < dirtyLow[row]) {
+    dirtyLow[row] = col;
+  } else if (col > dirtyHigh[row]) {
+    dirtyHigh[row] = col;
+  }
+}
+
+/**
+ * Clears the terminal and the shadow buffer. Call once, after os_init.
+ */
+void screen_init(void) {
+  mutex_init(&screenLock);
+  memset(cells, ' ', sizeof(cells));
+  memset(colors, 0, sizeof(colors));
+  memset(dirtyLow, CLEAN, sizeof(dirtyLow));
+  clear_screen();
+  cursorRow = 0;
+  currentColor = 0;
+}
+
+/**
+ * Draws a string, clipped at the right edge of the screen.
+ *
+ * @param row The row, 1 to MAX_ROW
+ * @param col The column of the first character, 1 to MAX_COL
+ * @param color The text color
+ * @param s The string
+ * @return The column after the string
+ */
+uint8_t screen_print(uint8_t row, uint8_t col, uint8_t color, char* s) {
+  return screen_print_field(row, col, color, s, 0);
+}
+
+/**
+ * Draws a string padded with spaces to a width, so that it covers whatever
+ * was drawn in the field before.
+ *
+ * @param row The row, 1 to MAX_ROW
+ * @param col The column of the first character, 1 to MAX_COL
+ * @param color The text color
+ * @param s The string
+ * @param width The width of the field
+ * @return The column after the string, not counting the padding
+ */
+uint8_t screen_print_field(uint8_t row, uint8_t col, uint8_t color, char* s,
+                           uint8_t width) {
+  uint8_t end = col + strlen(s);
+  if (row < 1 || row > MAX_ROW || col < 1) {
+    return end;
+  }
+  row--;
+  col--;
+  mutex_lock(&screenLock);
+  for (uint8_t n = 0; col < MAX_COL && (*s || n < width); col++, n++) {
+    set_cell(row, col, *s ? *s++ : ' ', color);
+  }
+  mutex_unlock(&screenLock);
+  return end;
+}
+
+uint8_t screen_print_int(uint8_t row, uint8_t col, uint8_t color, uint16_t i,
+                         uint8_t width) {
+  char s[FORMAT_INT_SIZE];
+  format_int(s, i);
+  return screen_print_field(row, col, color, s, width);
+}
+
+uint8_t screen_print_int32(uint8_t row, uint8_t col, uint8_t color,
+                           uint32_t i, uint8_t width) {
+  char s[FORMAT_INT32_SIZE];
+  format_int32(s, i);
+  return screen_print_field(row, col, color, s, width);
+}
+
+uint8_t screen_print_hex(uint8_t row, uint8_t col, uint8_t color, uint16_t i,
+                         uint8_t width) {
+  char s[FORMAT_HEX_SIZE];
+  format_hex(s, i);
+  return screen_print_field(row, col, color, s, width);
+}
+
+/**
+ * Sends the changes since the last flush to the terminal. Only the span of
+ * each row that changed is sent, the cursor is only moved when it is not
+ * already in place, and the color is only set when it changes.
+ */
+void screen_flush(void) {
+  mutex_lock(&screenLock);
+  for (uint8_t row = 0; row < MAX_ROW; row++) {
+    if (dirtyLow[row] == CLEAN) {
+      continue;
+    }
+    if (cursorRow != row + 1 || cursorCol != dirtyLow[row] + 1) {
+      set_cursor(row + 1, dirtyLow[row] + 1);
+    }
+    for (uint8_t col = dirtyLow[row]; col <= dirtyHigh[row]; col++) {
+      uint8_t color = cell_color(row, col);
+      if (color != currentColor && cells[row][col] != ' ') {
+        set_color(color);
+        currentColor = color;
+      }
+      write_byte(cells[row][col]);
+    }
+    dirtyLow[row] = CLEAN;
+    cursorRow = row + 1;
+    cursorCol = dirtyHigh[row] + 2;
+    // the cursor's position past the last column depends on the terminal
+    if (cursorCol > MAX_COL) {
+      cursorRow = 0;
+    }
+  }
+  mutex_unlock(&screenLock);
+}
+
+/**
+ * Holds off screen flushes until screen_unlock(), so that other output to
+ * the terminal, such as a telemetry frame, is not broken up by them. Calls
+ * may nest, and the screen_print functions also wait.
+ */
+void screen_lock(void) { mutex_lock(&screenLock); }
+
+/**
+ * Lets screen flushes resume after screen_lock().
+ */
+void screen_unlock(void) { mutex_unlock(&screenLock); }
+
+/**
+ * Clears the terminal and sends the whole screen at the next flush, e.g.
+ * after something else has written to the terminal.
+ */
+void screen_redraw(void) {
+  mutex_lock(&screenLock);
+  clear_screen();
+  // the terminal is blank, so only the text between the spaces is needed
+  for (uint8_t row = 0; row < MAX_ROW; row++) {
+    dirtyLow[row] = CLEAN;
+    for (uint8_t col = 0; col < MAX_COL; col++) {
+      if (cells[row][col] != ' ') {
+        if (dirtyLow[row] == CLEAN) {
+          dirtyLow[row] = col;
+        }
+        dirtyHigh[row] = col;
+      }
+    }
+  }
+  cursorRow = 0;
+  currentColor = 0;
+  mutex_unlock(&screenLock);
+}
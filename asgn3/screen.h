@@ -0,0 +1,24 @@
+#pragma once
+#include <stdint.h>
+
+// A model of the MAX_ROW x MAX_COL terminal. Threads draw into a shadow
+// buffer, and screen_flush() sends only the cells that changed, moving the
+// cursor and changing color only where needed. Rows and columns start at 1,
+// as with set_cursor, and colors are RED to WHITE (or 30 for black). The
+// screen_print functions return the column just past the text they drew, to
+// draw more text after it.
+
+void screen_init(void);
+uint8_t screen_print(uint8_t row, uint8_t col, uint8_t color, char* s);
+uint8_t screen_print_field(uint8_t row, uint8_t col, uint8_t color, char* s,
+                           uint8_t width);
+uint8_t screen_print_int(uint8_t row, uint8_t col, uint8_t color, uint16_t i,
+                         uint8_t width);
+uint8_t screen_print_int32(uint8_t row, uint8_t col, uint8_t color,
+                           uint32_t i, uint8_t width);
+uint8_t screen_print_hex(uint8_t row, uint8_t col, uint8_t color, uint16_t i,
+                         uint8_t width);
+void screen_flush(void);
+void screen_redraw(void);
+void screen_lock(void);
+void screen_unlock(void);
@@ -1,86 +1,454 @@
-#include <avr/io.h>
 #include "globals.h"
+#include "hal.h"
 #include "serial.h"
-#include <stdio.h>
+#include "os.h"
+#include "ring.h"
+#include <string.h>
 
+RING_DEFINE(tx_ring, uint8_t, SERIAL_TX_SIZE)
+RING_DEFINE(rx_ring, uint8_t, SERIAL_RX_SIZE)
+
+// output waiting for the transmit interrupt
+static struct tx_ring txRing;
+// writers blocked on a full buffer
+static struct thread_list txWaiters = {NO_THREAD};
+
+// input from the receive interrupt
+static struct rx_ring rxRing;
+// readers blocked on an empty buffer
+static struct thread_list rxWaiters = {NO_THREAD};
+// bytes lost because the buffer was full
+static volatile uint16_t rxDropped = 0;
 
 /*
  * Initialize the serial port.
  */
-void serial_init(void) {
-  uint16_t baud_setting;
+void serial_init(void) { hal_serial_init(); }
 
-  UCSR0A = _BV(U2X0);
-  baud_setting = 16; //115200 baud
+/*
+ * Return 1 if a character is available else return 0.
+ */
+uint8_t byte_available(void) {
+  return rx_ring_empty(&rxRing) ? 0 : 1;
+}
 
-  // assign the baud_setting
-  UBRR0H = baud_setting >> 8;
-  UBRR0L = baud_setting;
+/*
+ * Buffered read. Waits for a byte to arrive if none is buffered. Must not be
+ * called from the main thread unless timeout is NO_WAIT.
+ *
+ * b receives the byte.
+ * timeout the most ticks to wait, NO_WAIT or WAIT_FOREVER.
+ * Return WAIT_OK if a byte was read, WAIT_TIMEOUT otherwise.
+ */
+int8_t read_byte(uint8_t* b, uint16_t timeout) {
+  int8_t status = WAIT_OK;
+  cli();
+  // another reader may take the byte that woke us, so check again
+  while (rx_ring_empty(&rxRing) && status == WAIT_OK) {
+    if (timeout == NO_WAIT) {
+      status = WAIT_TIMEOUT;
+    } else {
+      status = thread_block(&rxWaiters, timeout, false);
+    }
+  }
+  if (status == WAIT_OK) {
+    rx_ring_get(&rxRing, b);
+  }
+  sei();
+  return status;
+}
 
-  // enable transmit and receive
-  UCSR0B |= (1 << TXEN0) | (1 << RXEN0);
+/*
+ * Reads a line ended by a carriage return or a newline, which is not stored.
+ * Empty lines are skipped, so a CR LF pair ends just one line. Characters
+ * beyond what fits in line are dropped.
+ *
+ * line receives the line, NUL terminated.
+ * size the size of line, at least 1.
+ * timeout the most ticks to wait for each character, or WAIT_FOREVER.
+ * Return WAIT_OK if a whole line was read, WAIT_TIMEOUT otherwise, leaving
+ * the partial line in line.
+ */
+int8_t read_line(char* line, uint8_t size, uint16_t timeout) {
+  uint8_t length = 0;
+  uint8_t b;
+  int8_t status;
+  while ((status = read_byte(&b, timeout)) == WAIT_OK) {
+    if (b == '\r' || b == '\n') {
+      if (length > 0) {
+        break;
+      }
+    } else if (length < size - 1) {
+      line[length++] = b;
+    }
+  }
+  line[length] = '\0';
+  return status;
 }
 
 /*
- * Return 1 if a character is available else return 0.
+ * Return the number of received bytes dropped because the input buffer was
+ * full.
  */
-uint8_t byte_available(void) {
-  return (UCSR0A & (1 << RXC0)) ? 1 : 0;
+uint16_t serial_rx_dropped(void) {
+  cli();
+  uint16_t dropped = rxDropped;
+  sei();
+  return dropped;
+}
+
+// Wakes a blocked reader and, if it outranks the interrupted thread,
+// switches to it now rather than at the next tick, by which time a fast
+// sender can have filled the buffer. The main thread may be asleep inside
+// hal_idle, so it is left to run the reader once it returns from there.
+static void wake_reader(void) {
+  if (wake_first(&rxWaiters) != NO_THREAD &&
+      sys->currentThreadId != MAIN_THREAD_ID) {
+    reschedule();
+  }
 }
 
 /*
- * Unbuffered read
- * Return 255 if no character is available otherwise return available character.
+ * Called by the receive interrupt with each byte received. Wakes a blocked
+ * reader, which runs straight away if its priority is higher than the
+ * thread that was interrupted, and otherwise at the next tick.
  */
-uint8_t read_byte(void) {
-  if (UCSR0A & (1 << RXC0)) return UDR0;
-  return 255;
+void serial_rx_byte(uint8_t b) {
+  if (!rx_ring_put(&rxRing, b)) {
+    rxDropped++;
+    return;
+  }
+  wake_reader();
 }
 
 /*
- * Unbuffered write
+ * For a receive interrupt that can store several bytes at once. Returns the
+ * free space that follows on in the input buffer, to be filled in place and
+ * passed to serial_rx_commit. When it returns 0, the buffer is full and
+ * bytes received go to serial_rx_byte to be counted as dropped.
+ *
+ * b receives the start of the space.
+ */
+uint8_t serial_rx_peek(uint8_t** b) {
+  uint8_t n;
+  *b = rx_ring_put_peek(&rxRing, &n);
+  return n;
+}
+
+/*
+ * Adds n bytes stored at serial_rx_peek to the input and wakes a blocked
+ * reader, as serial_rx_byte does.
+ */
+void serial_rx_commit(uint8_t n) {
+  rx_ring_put_commit(&rxRing, n);
+  wake_reader();
+}
+
+// Makes room in the output buffer, with interrupts disabled. The main thread
+// is the idle thread and must not block, so it sends the oldest byte itself.
+static void send_oldest_or_wait(void) {
+  uint8_t b;
+  if (sys->currentThreadId != MAIN_THREAD_ID) {
+    thread_block(&txWaiters, WAIT_FOREVER, false);
+  } else if (tx_ring_get(&txRing, &b)) {
+    hal_serial_write(b);
+  }
+}
+
+/*
+ * Buffered write, sent by the transmit interrupt. Blocks while the buffer is
+ * full, except in the main thread, which is the idle thread and must not
+ * block, so it sends the oldest byte itself to make room. Call after
+ * os_init.
  *
  * b byte to write.
  */
 uint8_t write_byte(uint8_t b) {
-  //loop until the send buffer is empty
-  while (((1 << UDRIE0) & UCSR0B) || !(UCSR0A & (1 << UDRE0))) {}
-
-  //write out the byte
-  UDR0 = b;
+  cli();
+  while (!tx_ring_put(&txRing, b)) {
+    send_oldest_or_wait();
+  }
+  hal_serial_tx_start();
+  sei();
   return 1;
 }
 
-void print_string(char* s) {
-  while (*s) {
-    write_byte(*s++);
+/*
+ * Buffered write of length bytes, copied into the output a run at a time
+ * rather than byte by byte, and otherwise like write_byte.
+ *
+ * data bytes to write.
+ * length number of bytes.
+ */
+void write_bytes(const uint8_t* data, uint16_t length) {
+  cli();
+  while (length > 0) {
+    uint8_t n = tx_ring_put_n(&txRing, data,
+                              length < UINT8_MAX ? length : UINT8_MAX);
+    if (n == 0) {
+      send_oldest_or_wait();
+      continue;
+    }
+    data += n;
+    length -= n;
+    hal_serial_tx_start();
+  }
+  sei();
+}
+
+/*
+ * Waits until all buffered output has been handed to the port.
+ */
+void serial_flush(void) {
+  cli();
+  while (!tx_ring_empty(&txRing)) {
+    send_oldest_or_wait();
+  }
+  sei();
+}
+
+// Wakes a blocked writer once sending brings the buffer down to half
+// empty, so writers refill it in batches rather than a byte at a time, or
+// once it is empty in case the last writer woken had little left to write.
+static void wake_writer(uint8_t before) {
+  uint8_t count = tx_ring_count(&txRing);
+  if (count == 0 ||
+      (before > SERIAL_TX_SIZE / 2 && count <= SERIAL_TX_SIZE / 2)) {
+    wake_first(&txWaiters);
   }
 }
 
+/*
+ * Called by the transmit interrupt for the next byte to send, waking a
+ * blocked writer when there is room.
+ *
+ * b receives the byte.
+ * Return true if there was a byte to send.
+ */
+bool serial_tx_next(uint8_t* b) {
+  if (!tx_ring_get(&txRing, b)) {
+    return false;
+  }
+  wake_writer(tx_ring_count(&txRing) + 1);
+  return true;
+}
+
+/*
+ * For a transmitter that can send several bytes at once. Returns the
+ * buffered output that follows on in memory, to be sent straight from the
+ * buffer and then passed to serial_tx_commit.
+ *
+ * b receives the start of the output.
+ */
+uint8_t serial_tx_peek(const uint8_t** b) {
+  uint8_t n;
+  *b = tx_ring_get_peek(&txRing, &n);
+  return n;
+}
+
+/*
+ * Frees n bytes sent from serial_tx_peek, waking a writer as
+ * serial_tx_next does.
+ */
+void serial_tx_commit(uint8_t n) {
+  uint8_t before = tx_ring_count(&txRing);
+  tx_ring_get_commit(&txRing, n);
+  wake_writer(before);
+}
+
+void print_string(char* s) {
+  write_bytes((uint8_t*)s, strlen(s));
+}
+
 void clear_screen(void) {
   print_string("\x1B[2J");
 }
 
 void print_int(uint16_t i) {
-  print_fmt_buf("%hu", i);
+  char s[FORMAT_INT_SIZE];
+  format_int(s, i);
+  print_string(s);
 }
 
 void print_int32(uint32_t i) {
-  print_fmt_buf("%lu", i);
+  char s[FORMAT_INT32_SIZE];
+  format_int32(s, i);
+  print_string(s);
 }
 
 void print_hex(uint16_t i) {
-  print_fmt_buf("%#hx", i);
+  char s[FORMAT_HEX_SIZE];
+  format_hex(s, i);
+  print_string(s);
 }
 
 void print_hex32(uint32_t i) {
-  print_fmt_buf("%#lx", i);
+  char s[FORMAT_HEX32_SIZE];
+  format_hex32(s, i);
+  print_string(s);
 }
 
 void set_color(uint8_t color) {
-  print_fmt_buf("\x1B[%dm", color);
+  char s[FORMAT_COLOR_SIZE];
+  format_color(s, color);
+  print_string(s);
 }
 
 void set_cursor(uint8_t row, uint8_t col) {
-  print_fmt_buf("\x1B[%d;%dH", row, col);
+  char s[FORMAT_CURSOR_SIZE];
+  format_cursor(s, row, col);
+  print_string(s);
+}
+
+/*
+ * Number formatting. The AVR has no divide instruction, so decimal digits
+ * are found by subtracting each power of ten in turn, which takes at most
+ * nine subtractions a digit. Each format_* function writes a NUL terminated
+ * string into a buffer of the matching FORMAT_*_SIZE and returns its length,
+ * with the same output as printf's %u and %#x.
+ */
+
+static const uint16_t powers16[] = {10000, 1000, 100, 10};
+static const uint32_t powers32[] = {1000000000, 100000000, 10000000,
+                                    1000000,    100000,    10000};
+static const char hexDigits[] = "0123456789abcdef";
+
+// the decimal digit for i's multiple of a power of ten, taking it off i
+#define SUBTRACT_DIGIT(digit, i, power)                                       \
+  do {                                                                         \
+    (digit) = '0';                                                             \
+    while ((i) >= (power)) {                                                   \
+      (i) -= (power);                                                          \
+      (digit)++;                                                               \
+    }                                                                          \
+  } while (0)
+
+// writes i in decimal without leading zeros, returning the end of s
+static char* put_decimal16(char* s, uint16_t i) {
+  bool leading = true;
+  for (uint8_t p = 0; p < sizeof(powers16) / sizeof(powers16[0]); p++) {
+    char digit;
+    SUBTRACT_DIGIT(digit, i, powers16[p]);
+    if (digit != '0' || !leading) {
+      *s++ = digit;
+      leading = false;
+    }
+  }
+  *s++ = '0' + i;
+  return s;
+}
+
+// writes i in decimal without leading zeros, returning the end of s
+static char* put_decimal32(char* s, uint32_t i) {
+  if (i <= UINT16_MAX) {
+    return put_decimal16(s, i);
+  }
+  bool leading = true;
+  for (uint8_t p = 0; p < sizeof(powers32) / sizeof(powers32[0]); p++) {
+    char digit;
+    SUBTRACT_DIGIT(digit, i, powers32[p]);
+    if (digit != '0' || !leading) {
+      *s++ = digit;
+      leading = false;
+    }
+  }
+  // what is left is below 10000 and needs all four digits
+  uint16_t low = i;
+  for (uint8_t p = 1; p < sizeof(powers16) / sizeof(powers16[0]); p++) {
+    SUBTRACT_DIGIT(*s, low, powers16[p]);
+    s++;
+  }
+  *s++ = '0' + low;
+  return s;
+}
+
+// writes a byte in decimal without leading zeros, returning the end of s
+static char* put_decimal8(char* s, uint8_t i) {
+  char digit;
+  if (i >= 100) {
+    SUBTRACT_DIGIT(digit, i, 100);
+    *s++ = digit;
+    SUBTRACT_DIGIT(*s, i, 10);
+    s++;
+  } else if (i >= 10) {
+    SUBTRACT_DIGIT(*s, i, 10);
+    s++;
+  }
+  *s++ = '0' + i;
+  return s;
+}
+
+// writes bytes, most significant first, in hex with a 0x prefix and without
+// leading zeros, or just 0 if they are all zero; returns the end of s
+static char* put_hex(char* s, const uint8_t* bytes, uint8_t count) {
+  while (count > 1 && *bytes == 0) {
+    bytes++;
+    count--;
+  }
+  if (count == 1 && *bytes == 0) {
+    *s++ = '0';
+    return s;
+  }
+  *s++ = '0';
+  *s++ = 'x';
+  if (*bytes < 0x10) {
+    // no leading zero nibble
+    *s++ = hexDigits[*bytes++];
+    count--;
+  }
+  while (count-- > 0) {
+    *s++ = hexDigits[*bytes >> 4];
+    *s++ = hexDigits[*bytes++ & 0x0F];
+  }
+  return s;
+}
+
+uint8_t format_int(char* s, uint16_t i) {
+  char* end = put_decimal16(s, i);
+  *end = '\0';
+  return end - s;
+}
+
+uint8_t format_int32(char* s, uint32_t i) {
+  char* end = put_decimal32(s, i);
+  *end = '\0';
+  return end - s;
+}
+
+uint8_t format_hex(char* s, uint16_t i) {
+  uint8_t bytes[] = {i >> 8, i};
+  char* end = put_hex(s, bytes, sizeof(bytes));
+  *end = '\0';
+  return end - s;
+}
+
+uint8_t format_hex32(char* s, uint32_t i) {
+  uint8_t bytes[] = {i >> 24, i >> 16, i >> 8, i};
+  char* end = put_hex(s, bytes, sizeof(bytes));
+  *end = '\0';
+  return end - s;
+}
+
+// the escape sequence that sets the text color, as set_color prints
+uint8_t format_color(char* s, uint8_t color) {
+  char* end = s;
+  *end++ = '\x1B';
+  *end++ = '[';
+  end = put_decimal8(end, color);
+  *end++ = 'm';
+  *end = '\0';
+  return end - s;
+}
+
+// the escape sequence that moves the cursor, as set_cursor prints
+uint8_t format_cursor(char* s, uint8_t row, uint8_t col) {
+  char* end = s;
+  *end++ = '\x1B';
+  *end++ = '[';
+  end = put_decimal8(end, row);
+  *end++ = ';';
+  end = put_decimal8(end, col);
+  *end++ = 'H';
+  *end = '\0';
+  return end - s;
 }
@@ -1,10 +1,38 @@
 #pragma once
+#include <stdbool.h>
 #include <stdint.h>
 
+// bytes of output buffered for the transmit interrupt, a power of two of at
+// most 128
+#ifndef SERIAL_TX_SIZE
+#define SERIAL_TX_SIZE 64
+#endif
+// bytes of input buffered by the receive interrupt, likewise. At 115200
+// baud 32 bytes arrive in under 3 ms, so a reader must outrank the threads
+// that keep the CPU busy to empty the buffer in time, as it is only switched
+// to straight away when it does. Otherwise it can wait for the next tick,
+// 10 ms, in which up to 116 bytes arrive and the excess is dropped (see
+// serial_rx_dropped).
+#ifndef SERIAL_RX_SIZE
+#define SERIAL_RX_SIZE 32
+#endif
+
+// buffer sizes for the format_* functions, including the NUL
+#define FORMAT_INT_SIZE 6     // 65535
+#define FORMAT_INT32_SIZE 11  // 4294967295
+#define FORMAT_HEX_SIZE 7     // 0xffff
+#define FORMAT_HEX32_SIZE 11  // 0xffffffff
+#define FORMAT_COLOR_SIZE 7   // ESC [ 255 m
+#define FORMAT_CURSOR_SIZE 11 // ESC [ 255 ; 255 H
+
 void serial_init(void);
 uint8_t byte_available(void);
-uint8_t read_byte(void);
+int8_t read_byte(uint8_t* b, uint16_t timeout);
+int8_t read_line(char* line, uint8_t size, uint16_t timeout);
+uint16_t serial_rx_dropped(void);
 uint8_t write_byte(uint8_t b);
+void write_bytes(const uint8_t* data, uint16_t length);
+void serial_flush(void);
 void print_string(char* s);
 void clear_screen(void);
 void print_int(uint16_t i);
@@ -13,3 +41,15 @@ void print_hex(uint16_t i);
 void print_hex32(uint32_t i);
 void set_color(uint8_t color);
 void set_cursor(uint8_t row, uint8_t col);
+uint8_t format_int(char* s, uint16_t i);
+uint8_t format_int32(char* s, uint32_t i);
+uint8_t format_hex(char* s, uint16_t i);
+uint8_t format_hex32(char* s, uint32_t i);
+uint8_t format_color(char* s, uint8_t color);
+uint8_t format_cursor(char* s, uint8_t row, uint8_t col);
+bool serial_tx_next(uint8_t* b);
+uint8_t serial_tx_peek(const uint8_t** b);
+void serial_tx_commit(uint8_t n);
+void serial_rx_byte(uint8_t b);
+uint8_t serial_rx_peek(uint8_t** b);
+void serial_rx_commit(uint8_t n);
@@ -1,22 +1,64 @@
 #pragma once
-#include "circular_buf.h"
+#include "os.h"
 #include <stdint.h>
 
 struct mutex_t {
-  uint8_t ownerId;
-  circular_buf_t waitingThreads;
-  bool lock;
+  uint8_t ownerId; // NO_THREAD when unlocked
+  uint8_t count;   // how many times the owner has locked it
+  struct thread_list waitingThreads; // highest priority first
+  struct mutex_t* nextHeld; // next mutex held by the same owner
 };
 
 struct semaphore_t {
-  int8_t value;
-  circular_buf_t waitingThreads;
+  int8_t value; // free permits, never negative
+  struct thread_list waitingThreads; // FIFO
 };
 
+// A fixed size queue of message pointers. Messages are never copied: the
+// sender passes a pointer and the receiver gets the same pointer back. The
+// ring is storage supplied by the caller, e.g. a static void* array.
+struct mqueue_t {
+  void** slots;
+  uint8_t size;  // number of slots
+  uint8_t head;  // slot holding the oldest message
+  uint8_t count; // messages in the ring
+  struct thread_list senders;   // threads waiting for a free slot, FIFO
+  struct thread_list receivers; // threads waiting for a message, FIFO
+};
+
+// A group of up to 8 event flags that threads can block on. Flags can be
+// set from threads or from interrupts.
+struct event_group_t {
+  uint8_t flags;
+  struct thread_list waitingThreads; // FIFO
+};
+
+// options for event_wait
+#define EVENT_WAIT_ANY 0x00 // wake when any of the flags is set
+#define EVENT_WAIT_ALL 0x01 // wake when all of the flags are set
+#define EVENT_CLEAR 0x02    // clear the flags that were waited for on wakeup
+
+// events published by the kernel through sysEvents
+#define SYS_EVENT_SECOND 0x01 // set once a second
+
+extern struct event_group_t sysEvents;
+
 void mutex_init(struct mutex_t* m);
 void mutex_lock(struct mutex_t* m);
-void mutex_unlock(struct mutex_t* m);
+int8_t mutex_lock_timed(struct mutex_t* m, uint16_t timeout);
+int8_t mutex_unlock(struct mutex_t* m);
 void sem_init(struct semaphore_t* s, int8_t value);
 void sem_wait(struct semaphore_t* s);
+int8_t sem_wait_timed(struct semaphore_t* s, uint16_t timeout);
 void sem_signal(struct semaphore_t* s);
 void sem_signal_swap(struct semaphore_t* s);
+void mq_init(struct mqueue_t* q, void** slots, uint8_t size);
+int8_t mq_send(struct mqueue_t* q, void* msg, uint16_t timeout);
+int8_t mq_receive(struct mqueue_t* q, void** msg, uint16_t timeout);
+uint8_t mq_count(struct mqueue_t* q);
+void event_init(struct event_group_t* e);
+int8_t event_wait(struct event_group_t* e, uint8_t flags, uint8_t options,
+                  uint8_t* result, uint16_t timeout);
+void event_set(struct event_group_t* e, uint8_t flags);
+void event_set_from_isr(struct event_group_t* e, uint8_t flags);
+void event_clear(struct event_group_t* e, uint8_t flags);
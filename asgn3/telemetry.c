@@ -0,0 +1,84 @@
+#include "telemetry.h"
+#include "hal.h"
+#include "os.h"
+#include "serial.h"
+#include "synchro.h"
+
+#define TELEMETRY_MAX_SAMPLE TELEMETRY_SAMPLE_SIZE(MAX_THREADS)
+
+// the thread count is a byte, and telemetry2csv takes no longer samples
+#if TELEMETRY_MAX_SAMPLE > TELEMETRY_MAX_SAMPLE_SIZE
+#error "a telemetry sample can hold at most 255 threads"
+#endif
+
+static uint8_t sample[TELEMETRY_MAX_SAMPLE];
+static uint16_t sampleLength;
+// one sample at a time, so that frames are not interleaved
+static struct mutex_t telemetryLock;
+
+static void put_u8(uint8_t v) { sample[sampleLength++] = v; }
+
+static void put_u16(uint16_t v) {
+  put_u8(v);
+  put_u8(v >> 8);
+}
+
+static void put_u32(uint32_t v) {
+  put_u16(v);
+  put_u16(v >> 16);
+}
+
+static void put_thread(uint8_t id) {
+  volatile struct thread_t* t = &sys->threads[id];
+  volatile struct thread_info* info = &sys->threadInfo[id];
+  put_u8(id);
+  put_u8(t->state << 4 | t->priority);
+  put_u8(info->cpuLoad);
+  put_u16(info->prevSchedCount);
+  put_u16(thread_stack_peak(id));
+  put_u16(info->stackSize);
+}
+
+static void put_serial(uint8_t b) { write_byte(b); }
+
+void telemetry_init(void) { mutex_init(&telemetryLock); }
+
+/**
+ * Writes a telemetry sample of every thread, including the main thread, to
+ * the serial port as one frame, described in telemetry.h. The threads keep
+ * running while it is taken, so the per-thread values are not one snapshot.
+ */
+void telemetry_send(void) {
+  mutex_lock(&telemetryLock);
+  sampleLength = 0;
+  put_u8(TELEMETRY_VERSION);
+  // the tick updates these, and they take more than one load on the AVR
+  cli();
+  uint32_t elapsed = sys->elapsedTime;
+  uint32_t switches = sys->switchCount;
+  sei();
+  put_u32(elapsed);
+  put_u32(switches);
+  // threads may exit or be created while the sample is taken, so count the
+  // ones actually put
+  uint8_t* countByte = &sample[sampleLength];
+  put_u8(0);
+  for (uint8_t i = 0; i < MAX_THREADS; i++) {
+    if (sys->threads[i].state != THREAD_FREE) {
+      put_thread(i);
+      (*countByte)++;
+    }
+  }
+
+  uint16_t crc = 0xFFFF;
+  for (uint16_t i = 0; i < sampleLength; i++) {
+    crc = telemetry_crc(crc, sample[i]);
+  }
+  put_u16(crc);
+
+  // a zero in front ends whatever was written before the frame
+  write_byte(0);
+  telemetry_cobs(sample, sampleLength, put_serial);
+  write_byte(0);
+  mutex_unlock(&telemetryLock);
+}
@@ -0,0 +1,66 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+
+// Binary telemetry, a compact alternative to the stats screen for programs
+// reading the serial port. telemetry_send() writes one sample of the kernel
+// state as a frame: the sample and its CRC are COBS encoded, so that the
+// frame holds no zero bytes, between two zero bytes. Frames can be mixed
+// with other output, and telemetry2csv picks them out of a capture.
+
+#define TELEMETRY_VERSION 1
+
+// A sample, little endian:
+//
+//   version, elapsed seconds (4 bytes), context switches (4 bytes)
+//   thread count, then per thread: id, state << 4 | priority, CPU load,
+//   runs in the last second (2 bytes), peak stack (2 bytes),
+//   stack size (2 bytes)
+//
+// followed by the CRC of all of it (2 bytes).
+#define TELEMETRY_HEADER_SIZE 10
+#define TELEMETRY_THREAD_SIZE 9
+#define TELEMETRY_CRC_SIZE 2
+#define TELEMETRY_SAMPLE_SIZE(threads)                                         \
+  (TELEMETRY_HEADER_SIZE + (threads)*TELEMETRY_THREAD_SIZE + TELEMETRY_CRC_SIZE)
+// the longest sample there can be, with a thread for every count, and its
+// frame, which adds a code byte for every 254 bytes and the two zeros
+#define TELEMETRY_MAX_SAMPLE_SIZE TELEMETRY_SAMPLE_SIZE(UINT8_MAX)
+#define TELEMETRY_MAX_FRAME_SIZE                                               \
+  (TELEMETRY_MAX_SAMPLE_SIZE + TELEMETRY_MAX_SAMPLE_SIZE / 254 + 3)
+
+// CRC-16/CCITT-FALSE, start from 0xFFFF
+static inline uint16_t telemetry_crc(uint16_t crc, uint8_t b) {
+  crc ^= (uint16_t)b << 8;
+  for (uint8_t i = 0; i < 8; i++) {
+    crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+  }
+  return crc;
+}
+
+// COBS encodes length bytes, passing the encoded bytes to put in order.
+// Each zero is dropped and a code byte in front of every run of non-zero
+// bytes gives the distance to the next zero, or is 255 for a run of 254
+// bytes with no zero implied after it, so a zero that follows such a run
+// starts the next one.
+static inline void telemetry_cobs(const uint8_t* data, uint16_t length,
+                                  void (*put)(uint8_t)) {
+  uint16_t start = 0;
+  while (true) {
+    uint16_t end = start;
+    while (end < length && data[end] != 0 && end - start < 254) {
+      end++;
+    }
+    put(end - start + 1);
+    for (uint16_t i = start; i < end; i++) {
+      put(data[i]);
+    }
+    if (end == length) {
+      return;
+    }
+    start = end - start < 254 ? end + 1 : end;
+  }
+}
+
+void telemetry_init(void);
+void telemetry_send(void);
@@ -0,0 +1,184 @@
+// Decodes the telemetry frames (see telemetry.h) in a serial capture into
+// CSV, one line per thread per sample. Everything between the frames, such as
+// the stats screen, is skipped, as are frames that fail their CRC, e.g.
+//
+//   ./program3_host | ./telemetry2csv > telemetry.csv
+//
+// With -t it instead checks that the COBS encoder and decoder round trip
+// data around the 254 byte run limit.
+#include "os.h"
+#include "telemetry.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// anything longer is not a frame
+#define MAX_FRAME TELEMETRY_MAX_FRAME_SIZE
+
+static const char* state_name(uint8_t state) {
+  switch (state) {
+  case THREAD_RUNNING:
+    return "running";
+  case THREAD_READY:
+    return "ready";
+  case THREAD_SLEEPING:
+    return "sleeping";
+  case THREAD_WAITING:
+    return "waiting";
+  default:
+    return "unknown";
+  }
+}
+
+static uint16_t get_u16(const uint8_t* p) { return p[0] | p[1] << 8; }
+
+static uint32_t get_u32(const uint8_t* p) {
+  return get_u16(p) | (uint32_t)get_u16(p + 2) << 16;
+}
+
+// undoes the COBS encoding in place, returning the decoded length or -1
+static int cobs_decode(uint8_t* frame, int length) {
+  int in = 0;
+  int out = 0;
+  while (in < length) {
+    uint8_t code = frame[in++];
+    if (code == 0 || in + code - 1 > length) {
+      return -1;
+    }
+    for (int i = 1; i < code; i++) {
+      frame[out++] = frame[in++];
+    }
+    if (code < 0xFF && in < length) {
+      frame[out++] = 0;
+    }
+  }
+  return out;
+}
+
+// prints a decoded sample, returning whether it was valid
+static bool print_sample(const uint8_t* s, int length) {
+  if (length < TELEMETRY_HEADER_SIZE + TELEMETRY_CRC_SIZE ||
+      s[0] != TELEMETRY_VERSION) {
+    return false;
+  }
+  uint16_t crc = 0xFFFF;
+  for (int i = 0; i < length - TELEMETRY_CRC_SIZE; i++) {
+    crc = telemetry_crc(crc, s[i]);
+  }
+  uint8_t count = s[TELEMETRY_HEADER_SIZE - 1];
+  if (crc != get_u16(s + length - TELEMETRY_CRC_SIZE) ||
+      length != TELEMETRY_HEADER_SIZE + count * TELEMETRY_THREAD_SIZE +
+                    TELEMETRY_CRC_SIZE) {
+    return false;
+  }
+
+  uint32_t elapsed = get_u32(s + 1);
+  uint32_t switches = get_u32(s + 5);
+  for (int i = 0; i < count; i++) {
+    const uint8_t* t = s + TELEMETRY_HEADER_SIZE + i * TELEMETRY_THREAD_SIZE;
+    printf("%u,%u,%d,%s,%d,%d,%u,%u,%u\n", elapsed, switches, t[0],
+           state_name(t[1] >> 4), t[1] & 0x0F, t[2], get_u16(t + 3),
+           get_u16(t + 5), get_u16(t + 7));
+  }
+  return true;
+}
+
+static uint8_t encoded[MAX_FRAME];
+static int encodedLength;
+
+static void put_encoded(uint8_t b) {
+  if (encodedLength < MAX_FRAME) {
+    encoded[encodedLength++] = b;
+  }
+}
+
+// encodes and decodes length bytes, returning whether they came back
+// unchanged with no zero in the encoding
+static bool round_trip(const uint8_t* data, uint16_t length) {
+  encodedLength = 0;
+  telemetry_cobs(data, length, put_encoded);
+  if (memchr(encoded, 0, encodedLength) != NULL) {
+    return false;
+  }
+  int decoded = cobs_decode(encoded, encodedLength);
+  return decoded == length && memcmp(encoded, data, length) == 0;
+}
+
+// Runs of non-zero bytes up to and past the 254 byte limit, each alone, then
+// followed by a zero, then by a zero and more data with another zero in it,
+// and the longest samples, with zeros spaced around the limit.
+static int self_test(void) {
+  static const int runs[] = {0, 1, 2, 100, 252, 253, 254, 255, 256, 508, 509};
+  static uint8_t data[TELEMETRY_MAX_SAMPLE_SIZE];
+  int failed = 0;
+  for (unsigned i = 0; i < sizeof(runs) / sizeof(runs[0]); i++) {
+    int run = runs[i];
+    memset(data, 0xAA, sizeof(data));
+    data[run] = 0;
+    data[run + 20] = 0;
+    int lengths[] = {run, run + 1, run + 30};
+    for (int j = 0; j < 3; j++) {
+      if (!round_trip(data, lengths[j])) {
+        printf("run of %d in %d bytes: round trip failed\n", run, lengths[j]);
+        failed++;
+      }
+    }
+  }
+  for (int spacing = 253; spacing <= 256; spacing++) {
+    for (int i = 0; i < TELEMETRY_MAX_SAMPLE_SIZE; i++) {
+      data[i] = i % spacing == 0 ? 0 : 1 + i % 255;
+    }
+    if (!round_trip(data, TELEMETRY_MAX_SAMPLE_SIZE)) {
+      printf("zeros every %d bytes: round trip failed\n", spacing);
+      failed++;
+    }
+  }
+  memset(data, 0xAA, sizeof(data));
+  if (!round_trip(data, TELEMETRY_MAX_SAMPLE_SIZE)) {
+    printf("no zeros: round trip failed\n");
+    failed++;
+  }
+  printf("telemetry2csv: COBS round trip %s\n", failed ? "FAILED" : "ok");
+  return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+int main(int argc, char** argv) {
+  if (argc > 1 && strcmp(argv[1], "-t") == 0) {
+    return self_test();
+  }
+
+  uint8_t frame[MAX_FRAME];
+  int length = 0;
+  bool overflow = false;
+  unsigned long samples = 0;
+  unsigned long bad = 0;
+
+  printf("elapsed,switches,thread,state,priority,load,runs,peak_stack,"
+         "stack_size\n");
+  for (int c; (c = getchar()) != EOF;) {
+    if (c != 0) {
+      if (length < MAX_FRAME) {
+        frame[length++] = c;
+      } else {
+        overflow = true;
+      }
+      continue;
+    }
+    // the bytes since the last zero, if any, may be a frame
+    if (length > 0) {
+      int decoded = overflow ? -1 : cobs_decode(frame, length);
+      if (decoded >= 0 && print_sample(frame, decoded)) {
+        samples++;
+      } else {
+        bad++;
+      }
+    }
+    length = 0;
+    overflow = false;
+  }
+  fprintf(stderr, "telemetry2csv: %lu samples, %lu other frames skipped\n",
+          samples, bad);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,122 @@
+#include "timer.h"
+#include "hal.h"
+#include "os.h"
+
+// active timers sorted by expiry, soonest first
+static struct timer_t* timers = NULL;
+// the timer thread waits here until the first timer expires
+static struct thread_list timerWait;
+static uint8_t timerStack[THREAD_STACK_SIZE(TIMER_STACK_SIZE)];
+
+// whether tick a comes before tick b, allowing for the count wrapping
+static bool before(uint32_t a, uint32_t b) { return (int32_t)(a - b) < 0; }
+
+// inserts an active timer in order of expiry, returning whether it is now
+// the first to run; interrupts must be disabled
+static bool timer_insert(struct timer_t* t) {
+  struct timer_t** link = &timers;
+  while (*link != NULL && !before(t->expires, (*link)->expires)) {
+    link = &(*link)->next;
+  }
+  t->next = *link;
+  *link = t;
+  return link == &timers;
+}
+
+// interrupts must be disabled
+static void timer_remove(struct timer_t* t) {
+  struct timer_t** link = &timers;
+  while (*link != NULL && *link != t) {
+    link = &(*link)->next;
+  }
+  if (*link != NULL) {
+    *link = t->next;
+  }
+  t->next = NULL;
+}
+
+// Runs the callbacks of expired timers, restarting the periodic ones, then
+// waits until the next timer expires or a sooner one is started.
+static void timer_thread(void* args) {
+  cli();
+  while (true) {
+    uint32_t now = isrCounterMilli;
+    while (timers != NULL && !before(now, timers->expires)) {
+      struct timer_t* t = timers;
+      timers = t->next;
+      if (t->period > 0) {
+        // keep to the original schedule rather than drifting
+        t->expires += t->period;
+        timer_insert(t);
+      } else {
+        t->active = false;
+        t->next = NULL;
+      }
+      sei();
+      t->callback(t->args);
+      cli();
+      now = isrCounterMilli;
+    }
+
+    uint16_t timeout = WAIT_FOREVER;
+    if (timers != NULL) {
+      uint32_t wait = timers->expires - now;
+      timeout = wait < WAIT_FOREVER ? wait : WAIT_FOREVER - 1;
+    }
+    thread_block(&timerWait, timeout, false);
+  }
+}
+
+/**
+ * Creates the thread that runs timer callbacks. Must be called once, before
+ * os_start, by programs that use timers.
+ */
+void timers_init(void) {
+  thread_list_init(&timerWait);
+  create_thread_static("timers", timer_thread, NULL, timerStack,
+                       sizeof(timerStack), TIMER_PRIORITY);
+}
+
+void timer_init(struct timer_t* t, timer_func callback, void* args) {
+  t->callback = callback;
+  t->args = args;
+  t->period = 0;
+  t->active = false;
+  t->next = NULL;
+}
+
+/**
+ * Starts or restarts a timer. Its callback runs on the timer thread once the
+ * given number of ticks has passed, and then every period ticks.
+ *
+ * @param t The address of the timer_t
+ * @param ticks Ticks until the first run, at least 1
+ * @param period Ticks between later runs, or 0 to run only once
+ */
+void timer_start(struct timer_t* t, uint16_t ticks, uint16_t period) {
+  cli();
+  if (t->active) {
+    timer_remove(t);
+  }
+  t->expires = isrCounterMilli + ticks;
+  t->period = period;
+  t->active = true;
+  if (timer_insert(t)) {
+    // the timer thread is waiting for a later timer
+    if (wake_first(&timerWait) != NO_THREAD) {
+      reschedule();
+    }
+  }
+  sei();
+}
+
+// Stops a timer so its callback no longer runs. Does nothing if the timer
+// is not running.
+void timer_stop(struct timer_t* t) {
+  cli();
+  if (t->active) {
+    timer_remove(t);
+    t->active = false;
+  }
+  sei();
+}
@@ -0,0 +1,30 @@
+#pragma once
+#include "os.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+// priority and stack size of the thread that runs timer callbacks
+#ifndef TIMER_PRIORITY
+#define TIMER_PRIORITY MAX_PRIORITY
+#endif
+#ifndef TIMER_STACK_SIZE
+#define TIMER_STACK_SIZE 128
+#endif
+
+typedef void (*timer_func)(void*);
+
+// A one-shot or periodic software timer. Callbacks run one at a time on the
+// timer thread's stack, so they must not block for long.
+struct timer_t {
+  timer_func callback;
+  void* args;
+  uint32_t expires;      // tick count the timer runs at
+  uint16_t period;       // ticks between runs, 0 for a one-shot timer
+  bool active;
+  struct timer_t* next;  // next timer to run, in order of expiry
+};
+
+void timers_init(void);
+void timer_init(struct timer_t* t, timer_func callback, void* args);
+void timer_start(struct timer_t* t, uint16_t ticks, uint16_t period);
+void timer_stop(struct timer_t* t);
@@ -0,0 +1,87 @@
+#include "trace.h"
+#include "hal.h"
+#include "os.h"
+#include "serial.h"
+#include <stdbool.h>
+
+#ifdef OS_TRACE
+
+#if TRACE_SIZE & (TRACE_SIZE - 1)
+#error "TRACE_SIZE must be a power of two"
+#endif
+
+struct trace_entry {
+  uint16_t time; // hal_trace_time()
+  uint8_t event;
+  uint8_t thread;
+  uint8_t arg;
+};
+
+static struct trace_entry traceBuffer[TRACE_SIZE];
+static uint16_t traceNext = 0; // index of the next entry, never wrapped
+static bool tracePaused = false;
+
+void trace_record(uint8_t event, uint8_t thread, uint8_t arg) {
+  if (tracePaused) {
+    return;
+  }
+  struct trace_entry* e = &traceBuffer[traceNext++ & (TRACE_SIZE - 1)];
+  e->time = hal_trace_time();
+  e->event = event;
+  e->thread = thread;
+  e->arg = arg;
+}
+
+static void write_u16(uint16_t v) {
+  write_byte(v);
+  write_byte(v >> 8);
+}
+
+/**
+ * Writes the trace buffer to the serial port, oldest event first, while
+ * recording is paused. All values are little endian:
+ *
+ *   magic "\0TRC", version
+ *   clock rate in Hz (4 bytes), subticks (2 bytes)
+ *   thread count, then each thread's name padded to MAX_NAME_LENGTH + 1
+ *   event count (2 bytes), then per event: time (2 bytes), event, thread, arg
+ *
+ * When subticks is 0, time is the low 16 bits of a clock running at the
+ * clock rate. Otherwise its high byte is the low byte of the tick count and
+ * its low byte counts subticks clock periods into the tick.
+ */
+void trace_dump(void) {
+  cli();
+  tracePaused = true;
+  uint16_t next = traceNext;
+  sei();
+
+  uint16_t count = next < TRACE_SIZE ? next : TRACE_SIZE;
+  write_bytes((const uint8_t*)TRACE_MAGIC, sizeof(TRACE_MAGIC) - 1);
+  write_byte(TRACE_VERSION);
+  uint32_t hz = HAL_CLOCK_HZ;
+  write_u16(hz);
+  write_u16(hz >> 16);
+  write_u16(HAL_TRACE_SUBTICKS);
+
+  write_byte(MAX_THREADS);
+  for (uint8_t i = 0; i < MAX_THREADS; i++) {
+    write_bytes((const uint8_t*)sys->threadInfo[i].threadName,
+                MAX_NAME_LENGTH + 1);
+  }
+
+  write_u16(count);
+  for (uint16_t i = next - count; i != next; i++) {
+    struct trace_entry* e = &traceBuffer[i & (TRACE_SIZE - 1)];
+    write_u16(e->time);
+    write_byte(e->event);
+    write_byte(e->thread);
+    write_byte(e->arg);
+  }
+
+  cli();
+  tracePaused = false;
+  sei();
+}
+
+#endif
@@ -0,0 +1,41 @@
+#pragma once
+#include <stdint.h>
+
+// Kernel tracing, enabled by building with -DOS_TRACE. Events go into a ring
+// buffer in RAM, overwriting the oldest, and trace_dump() streams them out
+// over serial for trace2json to decode.
+
+// number of events kept, a power of two
+#ifndef TRACE_SIZE
+#define TRACE_SIZE 128
+#endif
+
+enum trace_event {
+  TRACE_SWITCH = 1, // thread switched in, arg is the thread switched out
+  TRACE_ISR_ENTER,  // arg is a TRACE_IRQ_*
+  TRACE_ISR_EXIT,
+  TRACE_BLOCK,      // thread blocked, arg is a TRACE_OBJ_*
+  TRACE_WAKE,       // thread woken, arg is its WAIT_* status
+  TRACE_SLEEP       // thread went to sleep, arg is the ticks (at most 255)
+};
+
+#define TRACE_IRQ_TICK 0
+#define TRACE_IRQ_SECOND 1
+
+#define TRACE_OBJ_MUTEX 0
+#define TRACE_OBJ_SEM 1
+#define TRACE_OBJ_QUEUE 2
+#define TRACE_OBJ_EVENT 3
+
+// the start of a dump, followed by the header described in trace.c
+#define TRACE_MAGIC "\x00TRC"
+#define TRACE_VERSION 1
+
+#ifdef OS_TRACE
+// records an event; interrupts must be disabled
+#define TRACE(event, thread, arg) trace_record(event, thread, arg)
+void trace_record(uint8_t event, uint8_t thread, uint8_t arg);
+void trace_dump(void);
+#else
+#define TRACE(event, thread, arg)
+#endif
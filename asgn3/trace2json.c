@@ -0,0 +1,169 @@
+// Decodes a kernel trace dump (see trace_dump() in trace.c) into Chrome
+// trace JSON, which chrome://tracing and Perfetto can display. Reads the
+// serial capture on stdin, skipping anything before the dump, e.g.
+//
+//   ./trace2json < capture.bin > trace.json
+#include "os.h"
+#include "trace.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_NAME 16
+// tid of the interrupt track, past the highest thread id of 254
+#define ISR_TID (UINT8_MAX + 1)
+
+static int read_byte(void) {
+  int c = getchar();
+  if (c == EOF) {
+    fprintf(stderr, "trace2json: dump is truncated\n");
+    exit(EXIT_FAILURE);
+  }
+  return c;
+}
+
+static uint16_t read_u16(void) {
+  uint16_t low = read_byte();
+  return low | read_byte() << 8;
+}
+
+// reads up to the end of the magic that starts a dump
+static bool find_magic(void) {
+  const char* magic = TRACE_MAGIC;
+  size_t length = sizeof(TRACE_MAGIC) - 1;
+  size_t matched = 0;
+  int c;
+  while (matched < length && (c = getchar()) != EOF) {
+    if (c == (uint8_t)magic[matched]) {
+      matched++;
+    } else {
+      matched = c == (uint8_t)magic[0] ? 1 : 0;
+    }
+  }
+  return matched == length;
+}
+
+static const char* object_name(uint8_t object) {
+  switch (object) {
+  case TRACE_OBJ_MUTEX:
+    return "mutex";
+  case TRACE_OBJ_SEM:
+    return "semaphore";
+  case TRACE_OBJ_QUEUE:
+    return "queue";
+  case TRACE_OBJ_EVENT:
+    return "event";
+  default:
+    return "object";
+  }
+}
+
+static bool first = true;
+
+static void emit(const char* name, char phase, int tid, double ts) {
+  printf("%s\n{\"name\":\"%s\",\"ph\":\"%c\",\"pid\":1,\"tid\":%d,"
+         "\"ts\":%.1f%s}",
+         first ? "" : ",", name, phase, tid, ts,
+         phase == 'i' ? ",\"s\":\"t\"" : "");
+  first = false;
+}
+
+int main(void) {
+  if (!find_magic()) {
+    fprintf(stderr, "trace2json: no trace dump found\n");
+    return EXIT_FAILURE;
+  }
+  uint8_t version = read_byte();
+  if (version != TRACE_VERSION) {
+    fprintf(stderr, "trace2json: unknown version %d\n", version);
+    return EXIT_FAILURE;
+  }
+  uint32_t hz = read_u16();
+  hz |= (uint32_t)read_u16() << 16;
+  uint16_t subticks = read_u16();
+
+  uint8_t threadCount = read_byte();
+  char names[UINT8_MAX + 1][MAX_NAME];
+  printf("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+  for (int i = 0; i < threadCount; i++) {
+    // names are MAX_NAME_LENGTH + 1 bytes, always NUL terminated
+    int j = 0;
+    for (int c; (c = read_byte()) != 0; j++) {
+      if (j < MAX_NAME - 1) {
+        names[i][j] = c;
+      }
+    }
+    names[i][j < MAX_NAME - 1 ? j : MAX_NAME - 1] = '\0';
+    // the name's padding
+    for (j++; j < MAX_NAME_LENGTH + 1; j++) {
+      read_byte();
+    }
+    if (names[i][0] == '\0') {
+      strcpy(names[i], i == threadCount - 1 ? "main" : "unused");
+    }
+    printf("%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+           "\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+           first ? "" : ",", i, names[i]);
+    first = false;
+  }
+  printf(",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,"
+         "\"args\":{\"name\":\"interrupts\"}}",
+         ISR_TID);
+
+  // timestamps wrap, so count the wraps, assuming no gap between two
+  // events is longer than one wrap
+  uint32_t period = subticks ? 256UL * subticks : 65536UL;
+  uint64_t base = 0;
+  uint32_t previous = 0;
+  bool running[UINT8_MAX + 1] = {false};
+  uint16_t count = read_u16();
+  for (uint16_t i = 0; i < count; i++) {
+    uint16_t raw = read_u16();
+    uint8_t event = read_byte();
+    uint8_t thread = read_byte();
+    uint8_t arg = read_byte();
+
+    uint32_t time = subticks ? (raw >> 8) * subticks + (raw & 0xFF) : raw;
+    if (i > 0 && time < previous) {
+      base += period;
+    }
+    previous = time;
+    double ts = (base + time) * 1e6 / hz;
+
+    char name[64];
+    switch (event) {
+    case TRACE_SWITCH:
+      if (running[arg]) {
+        emit("running", 'E', arg, ts);
+        running[arg] = false;
+      }
+      emit("running", 'B', thread, ts);
+      running[thread] = true;
+      break;
+    case TRACE_ISR_ENTER:
+      emit(arg == TRACE_IRQ_TICK ? "tick" : "second", 'B', ISR_TID, ts);
+      break;
+    case TRACE_ISR_EXIT:
+      emit(arg == TRACE_IRQ_TICK ? "tick" : "second", 'E', ISR_TID, ts);
+      break;
+    case TRACE_BLOCK:
+      snprintf(name, sizeof(name), "block on %s", object_name(arg));
+      emit(name, 'i', thread, ts);
+      break;
+    case TRACE_WAKE:
+      emit(arg == 0 ? "wake" : "timeout", 'i', thread, ts);
+      break;
+    case TRACE_SLEEP:
+      snprintf(name, sizeof(name), "sleep %d ticks", arg);
+      emit(name, 'i', thread, ts);
+      break;
+    default:
+      fprintf(stderr, "trace2json: unknown event %d\n", event);
+      break;
+    }
+  }
+  printf("\n]}\n");
+  return EXIT_SUCCESS;
+}